@@ -41,8 +41,15 @@
 #include <OXRS_API.h>               // For REST API
 #include <WiFiManager.h>            // captive wifi AP config
 #include <MqttLogger.h>             // for mqtt and serial logging
+#include <esp_task_wdt.h>           // For loop supervisor
+#include <Preferences.h>            // For output state journal
+#include <mbedtls/sha1.h>           // For websocket handshake
+#include <mbedtls/base64.h>         // For websocket handshake
+#include <lwip/sockets.h>           // For non-blocking websocket writes
+#include <lwip/dns.h>               // For non-blocking broker lookups
 
 #include <WiFi.h>                   // For networking
+#include <WiFiUdp.h>                // For udp event stream
 #if defined(ETHMODE)
 #include <ETH.h>                    // For networking
 #include <SPI.h>                    // For ethernet
@@ -71,9 +78,151 @@ TwoWire I2Ctwo = TwoWire(1);
 // Internal constants used when output type parsing fails
 #define INVALID_OUTPUT_TYPE         99
 
-// Can have up to 8x PCF8575 on a single I2C bus
+// Internal event raised when an input exceeds its rate limit
+#define FLOOD_EVENT                 100
+
+// MQTT payloads are streamed into the client socket in chunks of this size
+#define MQTT_STREAM_CHUNK_SIZE      128
+
+// MQTT reconnect backoff (doubles on each failed attempt, with jitter)
+#define MQTT_BACKOFF_MIN_MS         1000
+#define MQTT_BACKOFF_MAX_MS         60000
+
+// Maximum time PubSubClient will wait for a response from the broker,
+// which is as long as the loop can block while connecting. The lookup and
+// TCP handshake before it are polled, and given up on after the timeout.
+#define MQTT_SOCKET_TIMEOUT_S       2
+#define MQTT_CONNECT_TIMEOUT_MS     5000
+
+// Input rate limiting - token bucket per input, refilled at the rate
+// limit and holding enough tokens for a burst of this many seconds
+#define DEFAULT_INPUT_RATE_LIMIT    20
+#define INPUT_BURST_SECONDS         2
+#define INPUT_SUMMARY_MS            1000
+
+// Output journal - output states persisted to NVS (which is wear levelled)
+// so they can be restored at boot. Changes are coalesced, and committed 
+// once outputs have been quiet for a while (or have been pending too long)
+// but never more often than the minimum interval.
+#define JOURNAL_NAMESPACE           "stio"
+#define JOURNAL_KEY                 "outputs"
+#define JOURNAL_QUIET_MS            1000
+#define JOURNAL_MAX_DELAY_MS        30000
+#define JOURNAL_MIN_INTERVAL_MS     5000
+
+// Capture - raw input words and output commands, recorded to a ring
+// buffer file on LittleFS for offline analysis
+#define CAPTURE_FILE                "/capture.bin"
+#define CAPTURE_FILE_SIZE           65536
+#define CAPTURE_MAGIC               0x43525853  // "SXRC"
+#define CAPTURE_BUFFER_RECORDS      64
+#define CAPTURE_FLUSH_MS            1000
+
+// Channel stats - event rates are decayed with this time constant
+#define STATS_RATE_TAU_MS           60000.0f
+#define DEFAULT_STATS_INTERVAL_S    60
+
+// Config and command payloads are parsed one array element at a time,
+// with everything else parsed into a single small document
+#define JSON_STREAM_REST_SIZE       1024
+#define JSON_STREAM_ELEMENT_SIZE    4096
+#define JSON_STREAM_KEY_SIZE        32
+
+// Input debounce pre-filter - a change must be seen on this many ticks in
+// a row, with the tick set so that spans the configured debounce time
+#define DEBOUNCE_TICKS              4
+#define DEFAULT_INPUT_DEBOUNCE_MS   0
+#define MAX_INPUT_DEBOUNCE_MS       1000
+
+// WebSocket event stream - on its own port, next to the REST API. Each 
+// client has a fixed size send buffer and is evicted if it can't keep up.
+#define WS_PORT                     81
+#define WS_MAX_CLIENTS              4
+#define WS_TX_BUFFER_SIZE           2048
+#define WS_RX_BUFFER_SIZE           136
+#define WS_REQUEST_MAX_LEN          1024
+#define WS_HANDSHAKE_TIMEOUT_MS     2000
+#define WS_STALL_TIMEOUT_MS         5000
+#define WS_EVENT_MAX_LEN            192
+#define WS_GUID                     "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+
+// UDP event stream - fixed size binary records, see tools/udp_events.py
+#define UDP_EVENT_MAGIC             0x4553    // "SE" on the wire
+#define UDP_EVENT_VERSION           1
+#define DEFAULT_UDP_EVENT_PORT      5147
+
+// Latency histograms - log2 buckets of microseconds, i.e. bucket n holds
+// samples under 2^(n+1)us and the last bucket everything longer
+#define LATENCY_BUCKETS             20
+#define DEFAULT_LATENCY_ALARM_MS    50
+
+// Idle pacing - once nothing has happened for the holdoff the loop 
+// sleeps between passes, optionally dropping the CPU clock while idle
+#define DEFAULT_IDLE_SLEEP_MS       0
+#define MAX_IDLE_SLEEP_MS           50
+#define IDLE_HOLDOFF_MS             1000
+#define IDLE_POLL_MS                5         // how often a sleep checks the sockets
+#define FULL_CPU_MHZ                240
+
+// Input sampling - a hardware timer reads the input boards at a fixed 
+// rate, queueing timestamped samples for the loop to process
+#define DEFAULT_INPUT_SAMPLE_HZ     0
+#define MIN_INPUT_SAMPLE_HZ         50
+#define MAX_INPUT_SAMPLE_HZ         1000
+#define SAMPLE_QUEUE_LENGTH         64
+#define SAMPLE_TIMER_NUM            1
+#define SAMPLE_TASK_STACK_SIZE      2048
+#define SAMPLE_TASK_PRIORITY        9
+
+// On-device benchmarks, see the /bench endpoint
+#define BENCH_FAST_ITERATIONS       1000
+#define BENCH_SLOW_ITERATIONS       10
+#define BENCH_ELEMENT_MAX_LEN       96
+#define BENCH_PAYLOAD_SIZE          ((CHANNEL_COUNT * 2 * BENCH_ELEMENT_MAX_LEN) + 128)
+#define BENCH_SLICE_US              20000
+#define BENCH_HEAP_HEADROOM         8192
+
+// Loop supervisor - flags a stall if a loop pass takes longer than the budget
+#define DEFAULT_LOOP_BUDGET_MS      250
+#define SUPERVISOR_INTERVAL_MS      10
+#define SUPERVISOR_STACK_SIZE       2048
+#define SUPERVISOR_CORE             0
+#define TASK_WDT_TIMEOUT_S          10
+#define STALL_RECORD_COUNT          8
+
+// Pulse outputs are a firmware type, handled outside of OXRS_Output, so
+// must not clash with any of the library output types
+#define PULSE                       10
+#define DEFAULT_PULSE_MS            250
+#define MIN_PULSE_MS                10
+#define MAX_PULSE_MS                60000
+#define PULSE_MAX_ACTIVE            16
+#define PULSE_TIMER_NUM             0
+#define PULSE_TICK_US               1000
+#define PULSE_TASK_STACK_SIZE       2048
+#define PULSE_TASK_PRIORITY         10
+
+// Interlock groups - at most one output in each group can be on
+#define INTERLOCK_MAX_GROUPS        32
+#define DEFAULT_INTERLOCK_DELAY_MS  50
+
+// Home Assistant discovery - entity configs published per loop pass
+#define HASS_ENTITIES_PER_PASS      2
+#define HASS_DEFAULT_PREFIX         "homeassistant"
+#define HASS_PREFIX_MAX_LEN         31
+
+// Scenes - stored output presets, persisted to LittleFS
+#define SCENE_MAX_COUNT             16
+#define SCENE_NAME_MAX_LEN          15
+#define SCENES_FILE                 "/scenes.bin"
+
+// Only the KC868-A128 layout is supported, 8x PCF8575 on each bus
+#define BOARD_MODEL                 "KC868-A128"
+
+// Can have up to 8x PCF8575 on a single I2C bus, in the order they are indexed
 const byte    PCF_I2C_ADDRESS[]     = { 0x24, 0x25, 0x21, 0x22, 0x26, 0x27, 0x20, 0x23 };
 const uint8_t PCF_COUNT             = sizeof(PCF_I2C_ADDRESS);
+const uint8_t CHANNEL_COUNT         = PCF_COUNT * PCF_PIN_COUNT;
 
 // Ethernet
 #if defined(ETHMODE)
@@ -90,7 +239,567 @@ const uint8_t PCF_COUNT             = sizeof(PCF_I2C_ADDRESS);
 #endif
 
 /*-------------------------- Internal datatypes --------------------------*/
+// Which part of loop() is currently running (tracked by the supervisor)
+enum loopPhase_t { PHASE_LOOP, PHASE_MQTT, PHASE_API, PHASE_OUTPUTS, PHASE_INPUTS };
 
+// A loop pass which exceeded the loop budget
+struct stallRecord_t
+{
+  uint32_t uptimeMs;                // when the stall was first detected
+  uint32_t durationMs;              // how long the phase had been running
+  uint8_t phase;
+  bool published;
+};
+
+// An output pulse in progress, counted down by the pulse timer
+struct pulse_t
+{
+  uint8_t pcf;
+  uint8_t pin;
+  volatile uint16_t remainingMs;
+  volatile bool active;
+};
+
+// Debounces all 16 inputs of a board at once, using a 2-bit vertical 
+// counter per pin, i.e. bit n of count0/count1 is the counter for pin n
+struct debounce_t
+{
+  uint16_t state;                   // debounced word
+  uint16_t count0;
+  uint16_t count1;
+  uint16_t tickMs;                  // 0 to pass raw words straight through
+  uint32_t lastMs;
+  bool primed;
+};
+
+// State of a websocket client slot
+enum wsState_t { WS_FREE, WS_HANDSHAKE, WS_OPEN };
+
+// A websocket client, the send buffer holds the handshake request until
+// the connection is open and queued frames after that
+struct wsClient_t
+{
+  WiFiClient client;
+  uint8_t state;                    // wsState_t
+  uint32_t progressMs;              // when the handshake started, or we last sent anything
+  uint16_t txLength;
+  uint8_t rxLength;
+  uint8_t tx[WS_TX_BUFFER_SIZE];
+  uint8_t rx[WS_RX_BUFFER_SIZE];
+};
+
+// A timestamped read of every input board, queued by the sample task
+struct inputSample_t
+{
+  uint32_t ms;
+  uint32_t us;
+  uint8_t read;                     // which boards were read ok
+  uint16_t words[PCF_COUNT];
+};
+
+// Input sampling stats, written by the sample task
+struct sampleStats_t
+{
+  uint32_t samples;
+  uint32_t missed;
+  uint32_t dropped;
+  uint32_t jitterMaxUs;
+  uint64_t jitterTotalUs;
+};
+
+// Kinds of event sent on the udp event stream
+enum udpEventKind_t { UDP_EVENT_INPUT, UDP_EVENT_OUTPUT };
+
+// A single event on the udp event stream, little-endian on the wire
+struct __attribute__((packed)) udpEventRecord_t
+{
+  uint16_t magic;
+  uint8_t version;
+  uint8_t kind;                     // udpEventKind_t
+  uint32_t sequence;                // per device, receivers can spot gaps
+  uint32_t ms;                      // uptime when the event was raised
+  uint8_t index;
+  uint8_t type;                     // input or output type
+  uint8_t state;                    // raw event state, as passed to the handler
+  uint8_t reserved;
+  uint16_t suppressed;              // rate limiter summaries only
+};
+
+// Stages we measure the latency of
+enum latencyStage_t { LATENCY_COMMAND, LATENCY_INPUT, LATENCY_STAGES };
+
+// Latency samples for a single stage, since boot or the last reset
+struct latencyHistogram_t
+{
+  uint32_t buckets[LATENCY_BUCKETS];
+  uint32_t count;
+  uint32_t exceeded;                // samples over the alarm threshold
+  uint32_t maxUs;
+  uint64_t totalUs;
+};
+
+// Outputs in an interlock group, can span any number of PCFs
+struct interlockGroup_t
+{
+  uint16_t mask[PCF_COUNT];
+};
+
+// A scene compiled down to the PCF words it needs to write
+struct scene_t
+{
+  char name[SCENE_NAME_MAX_LEN + 1];
+  uint16_t mask[PCF_COUNT];         // which pins the scene sets
+  uint16_t value[PCF_COUNT];        // the level to set them to
+};
+
+// Event counter and decayed event rate for a single input or output
+struct channelStats_t
+{
+  uint32_t count;
+  uint32_t lastMs;
+  float rate;                       // events per minute
+};
+
+// Handler settings for a single output, applied only when they change
+struct outputConfig_t
+{
+  uint8_t type;
+  uint8_t interlock;                // pin on the same PCF, itself if unlocked
+  uint16_t timerSeconds;
+};
+
+// Handler settings for a single input, applied only when they change
+struct inputConfig_t
+{
+  uint8_t type;
+  uint8_t rateLimit;
+  bool invert;
+  bool disabled;
+};
+
+// Output states persisted to the journal, only pins in the mask are restored
+struct journal_t
+{
+  uint16_t mask[PCF_COUNT];
+  uint16_t state[PCF_COUNT];
+};
+
+// Types of captured record
+enum captureKind_t { CAPTURE_INPUT, CAPTURE_OUTPUT, CAPTURE_SCENE };
+
+// A single captured record. Input words are run-length encoded, i.e. an
+// input record is only written when the raw word for that PCF changes 
+// and the value holds until the next record for the same PCF.
+struct captureRecord_t
+{
+  uint32_t ms;                      // uptime when captured
+  uint8_t kind;                     // captureKind_t
+  uint8_t id;                       // PCF (input), index - 1 (output), or scene
+  uint16_t value;                   // raw input word, or output state
+};
+
+// Header at the start of the capture file, followed by the ring of records
+struct captureHeader_t
+{
+  uint32_t magic;
+  uint32_t head;                    // offset of the next record to write
+  uint32_t wrapped;                 // non-zero once the ring is full
+};
+
+// Token bucket rate limiter for a single input
+struct inputLimiter_t
+{
+  uint32_t tokens;                  // in 1/1000ths of an event
+  uint32_t lastMs;
+  uint16_t events;                  // in the current summary window
+  uint16_t suppressed;              // in the current summary window
+  uint8_t rateLimit;                // events per second, 0 to disable
+  uint8_t lastType;
+  uint8_t lastState;
+  bool flooding;
+};
+
+// A single on-device benchmark, run for a number of iterations
+struct benchmark_t
+{
+  const char * name;
+  uint16_t iterations;
+  size_t heapBytes;                 // largest allocation it needs, 0 if none
+  bool (*prepare)(void);            // optional, false if it can't run
+  void (*run)(uint16_t iteration);
+};
+
+// Where a /bench run has got to
+enum benchState_t { BENCH_IDLE, BENCH_RUNNING, BENCH_DONE };
+
+struct benchResult_t
+{
+  uint16_t iterations;              // completed so far
+  uint32_t totalUs;
+  bool skipped;                     // not enough heap to run it
+};
+
+// Handles the elements of a top-level json array one at a time
+struct jsonArrayHandler_t
+{
+  const char * key;
+  void (*begin)(void);               // optional
+  void (*element)(JsonVariant json);
+  void (*end)(void);                 // optional
+};
+
+// Walks the members of a json object (or elements of an array) without
+// parsing them, so each can be parsed on its own into a small document
+class JsonScanner
+{
+  public:
+    JsonScanner(const char * json, size_t length) : _p(json), _end(json + length), _close(0), _first(true) {}
+
+    // Call first, with '{' for an object or '[' for an array
+    bool begin(char open)
+    {
+      _skipSpace();
+      if (_p == _end || *_p != open) { return false; }
+
+      _close = open == '{' ? '}' : ']';
+      _p++;
+      return true;
+    }
+
+    // Returns the next member (key is NULL for arrays), or false at the 
+    // end of the object/array or if it is malformed
+    bool next(char key[], size_t keySize, const char ** value, size_t * length)
+    {
+      _skipSpace();
+      if (_p == _end || *_p == _close) { return false; }
+
+      if (!_first)
+      {
+        if (*_p != ',') { return false; }
+        _p++;
+        _skipSpace();
+      }
+      _first = false;
+
+      if (key != NULL)
+      {
+        if (_p == _end || *_p != '"') { return false; }
+
+        const char * start = ++_p;
+        while (_p < _end && *_p != '"') { _p += (*_p == '\\') ? 2 : 1; }
+        if (_p >= _end) { return false; }
+
+        size_t keyLength = min((size_t)(_p - start), keySize - 1);
+        memcpy(key, start, keyLength);
+        key[keyLength] = 0;
+
+        _p++;
+        _skipSpace();
+        if (_p == _end || *_p != ':') { return false; }
+        _p++;
+        _skipSpace();
+      }
+
+      const char * start = _p;
+      if (!_skipValue()) { return false; }
+
+      *value = start;
+      *length = _p - start;
+      return true;
+    }
+
+  private:
+    const char * _p;
+    const char * _end;
+    char _close;
+    bool _first;
+
+    void _skipSpace()
+    {
+      while (_p < _end && (*_p == ' ' || *_p == '\t' || *_p == '\r' || *_p == '\n')) { _p++; }
+    }
+
+    // Leaves _p just past the value (or on the delimiter after a scalar)
+    bool _skipValue()
+    {
+      uint8_t depth = 0;
+      bool inString = false;
+
+      for (; _p < _end; _p++)
+      {
+        if (inString)
+        {
+          if (*_p == '\\') { _p++; }
+          else if (*_p == '"')
+          {
+            inString = false;
+            if (depth == 0) { _p++; return true; }
+          }
+          continue;
+        }
+
+        switch (*_p)
+        {
+          case '"':
+            inString = true;
+            break;
+          case '{':
+          case '[':
+            depth++;
+            break;
+          case '}':
+          case ']':
+            if (depth == 0) { return true; }
+            if (--depth == 0) { _p++; return true; }
+            break;
+          case ',':
+            if (depth == 0) { return true; }
+            break;
+        }
+      }
+
+      return depth == 0 && !inString;
+    }
+};
+
+// Counts the bytes written to it, so a payload can be measured before
+// it is streamed
+class CountingPrint : public Print
+{
+  public:
+    CountingPrint() : _count(0) {}
+
+    size_t write(uint8_t b) { _count++; return 1; }
+    size_t write(const uint8_t * buffer, size_t size) { _count += size; return size; }
+
+    size_t count() { return _count; }
+
+  private:
+    size_t _count;
+};
+
+// Streams a payload straight into the MQTT client socket in small chunks,
+// avoiding any intermediate copy of the full payload
+class MqttStream : public Print
+{
+  public:
+    MqttStream(PubSubClient& client) : _client(client), _length(0), _written(0) {}
+
+    size_t write(uint8_t b)
+    {
+      _buffer[_length++] = b;
+      if (_length == sizeof(_buffer)) { flush(); }
+      return 1;
+    }
+
+    size_t write(const uint8_t * buffer, size_t size)
+    {
+      for (size_t i = 0; i < size; i++) { write(buffer[i]); }
+      return size;
+    }
+
+    void flush()
+    {
+      if (_length == 0) { return; }
+      _written += _client.write(_buffer, _length);
+      _length = 0;
+    }
+
+    size_t written() { return _written; }
+
+  private:
+    PubSubClient& _client;
+    uint8_t _buffer[MQTT_STREAM_CHUNK_SIZE];
+    size_t _length;
+    size_t _written;
+};
+
+// WiFiClient which connects to the broker without blocking. The first
+// connect() from PubSubClient starts the DNS lookup and TCP handshake and
+// returns 0, loopMqtt() then polls them every pass, and once the broker has
+// accepted the connection the next connect() hands the socket over, so only
+// the MQTT handshake (bounded by the socket timeout) is left to block.
+class MqttConnectClient : public WiFiClient
+{
+  public:
+    using WiFiClient::connect;
+
+    int connect(IPAddress ip, uint16_t port) override
+    {
+      if (!connecting() && !begin(ip, port)) { return 0; }
+      return handover();
+    }
+
+    int connect(const char * host, uint16_t port) override
+    {
+      if (connecting()) { return handover(); }
+
+      IPAddress ip;
+      if (ip.fromString(host)) { return connect(ip, port); }
+
+      // Hostnames are looked up by lwip in the background, answered
+      // straight away if it has the name cached
+      _attempts++;
+      _startMs = millis();
+      _port = port;
+      _resolved = false;
+      _resolving = true;
+
+      ip_addr_t addr;
+      err_t err = dns_gethostbyname(host, &addr, &MqttConnectClient::dnsFound, this);
+      if (err == ERR_OK) 
+      { 
+        _resolving = false;
+        if (!open(IPAddress(ip_2_ip4(&addr)->addr), port))
+        {
+          finish(false);
+          return 0;
+        }
+        return handover();
+      }
+      if (err != ERR_INPROGRESS) { finish(false); }
+      return 0;
+    }
+
+    bool connecting() { return _resolving || _fd >= 0; }
+    uint32_t attempts() { return _attempts; }
+
+    // Polls the lookup and connect in progress, true once the broker has
+    // accepted the connection and the next connect() will hand it over
+    bool poll()
+    {
+      if (_resolving)
+      {
+        if (!_resolved)
+        {
+          if ((millis() - _startMs) > MQTT_CONNECT_TIMEOUT_MS) { finish(false); }
+          return false;
+        }
+
+        _resolving = false;
+        if (_ip == 0 || !open(IPAddress(_ip), _port)) 
+        { 
+          finish(false);
+          return false; 
+        }
+      }
+
+      if (_fd < 0) { return false; }
+
+      fd_set fds;
+      FD_ZERO(&fds);
+      FD_SET(_fd, &fds);
+      struct timeval timeout = { 0, 0 };
+
+      if (lwip_select(_fd + 1, NULL, &fds, NULL, &timeout) <= 0)
+      {
+        if ((millis() - _startMs) > MQTT_CONNECT_TIMEOUT_MS) { finish(false); }
+        return false;
+      }
+
+      int err = 0;
+      socklen_t length = sizeof(err);
+      if (lwip_getsockopt(_fd, SOL_SOCKET, SO_ERROR, &err, &length) < 0 || err != 0)
+      {
+        finish(false);
+        return false;
+      }
+
+      return true;
+    }
+
+    // How long the last attempt took, once only, after it has finished
+    bool takeConnectingMs(uint32_t * connectingMs)
+    {
+      if (!_finished) { return false; }
+      *connectingMs = _connectingMs;
+      _finished = false;
+      return true;
+    }
+
+    void abort()
+    {
+      if (!connecting()) { return; }
+      finish(false);
+    }
+
+  private:
+    int _fd = -1;
+    uint16_t _port = 0;
+    uint32_t _startMs = 0;
+    uint32_t _attempts = 0;
+    uint32_t _connectingMs = 0;
+    bool _finished = false;
+
+    // Written by the lwip callback, which can still arrive after an
+    // attempt has been abandoned, so only trusted while _resolving
+    bool _resolving = false;
+    volatile bool _resolved = false;
+    volatile uint32_t _ip = 0;
+
+    static void dnsFound(const char * name, const ip_addr_t * addr, void * arg)
+    {
+      MqttConnectClient * self = (MqttConnectClient *)arg;
+      self->_ip = addr ? ip_2_ip4(addr)->addr : 0;
+      self->_resolved = true;
+    }
+
+    bool begin(IPAddress ip, uint16_t port)
+    {
+      _attempts++;
+      _startMs = millis();
+
+      if (!open(ip, port)) 
+      { 
+        finish(false);
+        return false; 
+      }
+      return true;
+    }
+
+    bool open(IPAddress ip, uint16_t port)
+    {
+      _fd = lwip_socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+      if (_fd < 0) { return false; }
+
+      lwip_fcntl(_fd, F_SETFL, lwip_fcntl(_fd, F_GETFL, 0) | O_NONBLOCK);
+
+      struct sockaddr_in addr;
+      memset(&addr, 0, sizeof(addr));
+      addr.sin_family = AF_INET;
+      addr.sin_addr.s_addr = (uint32_t)ip;
+      addr.sin_port = htons(port);
+
+      return lwip_connect(_fd, (struct sockaddr *)&addr, sizeof(addr)) == 0 || errno == EINPROGRESS;
+    }
+
+    int handover()
+    {
+      if (!poll()) { return 0; }
+
+      // Connected, so blocking again and handed over like any other client
+      lwip_fcntl(_fd, F_SETFL, lwip_fcntl(_fd, F_GETFL, 0) & ~O_NONBLOCK);
+      finish(true);
+      return 1;
+    }
+
+    void finish(bool connected)
+    {
+      if (connected) 
+      { 
+        WiFiClient::operator=(WiFiClient(_fd)); 
+      }
+      else if (_fd >= 0)
+      {
+        lwip_close(_fd);
+      }
+
+      _fd = -1;
+      _resolving = false;
+      _finished = true;
+      _connectingMs = millis() - _startMs;
+    }
+};
 
 /*--------------------------- Global Variables ---------------------------*/
 // OUTPUTS - Each bit corresponds to an PCF found on the I2C bus
@@ -105,6 +814,251 @@ uint8_t g_pcfs_found_di = 0;
 // in the boot sequence to configure the LCD and adoption payloads
 uint8_t g_pcf_output_pins = PCF_PIN_COUNT;
 
+// OUTPUTS - Current state of each output pin, written to the PCF as a
+// single word. Shared with the pulse task so always take the mutex.
+uint16_t g_do_shadow[PCF_COUNT];
+SemaphoreHandle_t g_do_mutex = NULL;
+
+// OUTPUTS - Pins configured as 'relay', which can be written directly
+// without going through the output handler (i.e. by scenes)
+uint16_t g_pcf_relay_pins[PCF_COUNT];
+
+// Config as applied to the handlers, and as staged by the config being
+// received. Only channels whose staged config differs are touched when
+// the config is committed, so a retained config push is cheap.
+outputConfig_t g_output_config[PCF_COUNT][PCF_PIN_COUNT];
+outputConfig_t g_output_config_staging[PCF_COUNT][PCF_PIN_COUNT];
+inputConfig_t g_input_config[PCF_COUNT][PCF_PIN_COUNT];
+inputConfig_t g_input_config_staging[PCF_COUNT][PCF_PIN_COUNT];
+bool g_config_staging = false;
+
+// OUTPUTS - Pins to restore at boot, set via "restore" output config
+uint16_t g_pcf_restore_pins[PCF_COUNT];
+
+// Output journal - last committed, and when things last changed
+journal_t g_journal;
+bool g_journal_pending = false;
+uint32_t g_journal_change_ms = 0;
+uint32_t g_journal_pending_ms = 0;
+uint32_t g_journal_commit_ms = 0;
+
+// Interlock groups - set via "interlockGroups" config option, only
+// changed while holding the output mutex since every write checks them
+interlockGroup_t g_interlock_groups[INTERLOCK_MAX_GROUPS];
+uint8_t g_interlock_group_count = 0;
+uint8_t g_interlock_group_of[PCF_COUNT][PCF_PIN_COUNT];
+uint16_t g_interlock_pins[PCF_COUNT];
+
+// Interlock groups - staged from config, before replacing the current groups
+interlockGroup_t g_interlock_groups_staging[INTERLOCK_MAX_GROUPS];
+uint8_t g_interlock_groups_staged = 0;
+
+// Set via "interlockDelayMs" integer config option
+uint32_t g_interlock_delay_ms = DEFAULT_INTERLOCK_DELAY_MS;
+
+// Outputs switched off by an interlock group, waiting to be published.
+// Only accessed while holding the output mutex.
+uint16_t g_interlock_publish[PCF_COUNT];
+
+// Outputs waiting for the rest of their group to break before they are
+// switched on, by the loop once the deadline has passed. Only accessed
+// while holding the output mutex.
+uint16_t g_interlock_make[PCF_COUNT];
+volatile bool g_interlock_making = false;
+uint32_t g_interlock_make_ms = 0;
+
+// Outputs waiting to make whose on event is held back until they do, so
+// the event never runs ahead of the relay. Only accessed while holding
+// the output mutex.
+uint16_t g_interlock_make_publish[PCF_COUNT];
+
+// Scenes - set via "scenes" config option
+scene_t g_scenes[SCENE_MAX_COUNT];
+uint8_t g_scene_count = 0;
+
+// Scenes - compiled from config, before replacing the current scenes
+scene_t g_scenes_staging[SCENE_MAX_COUNT];
+uint8_t g_scenes_staged = 0;
+
+// Pulse duration for each output, set via "pulseMs" output config
+uint16_t g_pulse_ms[PCF_COUNT][PCF_PIN_COUNT];
+
+// Pulses in progress - counted down in the pulse timer ISR
+pulse_t g_pulses[PULSE_MAX_ACTIVE];
+portMUX_TYPE g_pulse_mux = portMUX_INITIALIZER_UNLOCKED;
+hw_timer_t * g_pulse_timer = NULL;
+TaskHandle_t g_pulse_task = NULL;
+
+// Outputs switched off by the pulse task, waiting to be published
+volatile uint16_t g_pulse_publish[PCF_COUNT];
+
+// UDP event stream - set via "udpEventAddress" and "udpEventPort" config options
+bool g_udp_events = false;
+IPAddress g_udp_event_ip;
+uint16_t g_udp_event_port = DEFAULT_UDP_EVENT_PORT;
+uint32_t g_udp_event_sequence = 0;
+uint32_t g_udp_event_failures = 0;
+
+// INPUTS - Last word passed to the input handlers, for websocket snapshots
+uint16_t g_di_words[PCF_COUNT];
+
+// WebSocket clients
+wsClient_t g_ws_clients[WS_MAX_CLIENTS];
+uint8_t g_ws_clients_open = 0;
+uint32_t g_ws_evictions = 0;
+
+// INPUTS - Debounce pre-filter, set via "inputDebounceMs" config option
+debounce_t g_input_debounce[PCF_COUNT];
+
+// INPUTS - Rate limiters, set via "rateLimit" input config
+inputLimiter_t g_input_limiters[CHANNEL_COUNT];
+uint8_t g_inputs_flooding = 0;
+uint32_t g_input_summary_ms = 0;
+
+// Capture state - set via "capture" command
+bool g_capture_active = false;
+captureHeader_t g_capture_header;
+captureRecord_t g_capture_buffer[CAPTURE_BUFFER_RECORDS];
+uint8_t g_capture_buffered = 0;
+uint32_t g_capture_flush_ms = 0;
+uint16_t g_capture_last_word[PCF_COUNT];
+uint8_t g_capture_pcfs_seen = 0;
+
+// Per channel stats - only ever updated from the loop
+channelStats_t g_input_stats[CHANNEL_COUNT];
+channelStats_t g_output_stats[CHANNEL_COUNT];
+
+// Set via "statsIntervalSeconds" integer config option (0 to disable)
+uint32_t g_stats_interval_ms = DEFAULT_STATS_INTERVAL_S * 1000L;
+uint32_t g_stats_last_ms = 0;
+
+// Loop supervisor state - written by loop(), read by the supervisor task
+volatile uint8_t g_loop_phase = PHASE_LOOP;
+volatile uint32_t g_loop_phase_start_ms = 0;
+volatile uint32_t g_loop_pass_start_ms = 0;
+volatile bool g_loop_sleeping = false;
+
+// Set via "loopBudgetMs" integer config option
+uint32_t g_loop_budget_ms = DEFAULT_LOOP_BUDGET_MS;
+
+// Ring of the most recent stalls - written by the supervisor task
+stallRecord_t g_stalls[STALL_RECORD_COUNT];
+uint8_t g_stall_head = 0;
+uint8_t g_stall_count = 0;
+uint32_t g_stall_pass_start_ms = 0;
+volatile bool g_stall_unpublished = false;
+portMUX_TYPE g_stall_mux = portMUX_INITIALIZER_UNLOCKED;
+
+// MQTT reconnect state
+uint32_t g_mqtt_backoff_ms = 0;
+uint32_t g_mqtt_next_attempt_ms = 0;
+
+// MQTT reconnect stats - since the last connect, and since boot
+uint32_t g_mqtt_outage_attempts = 0;
+uint32_t g_mqtt_outage_connecting_ms = 0;
+uint32_t g_mqtt_total_attempts = 0;
+uint32_t g_mqtt_total_connecting_ms = 0;
+uint32_t g_mqtt_connects = 0;
+
+// Metrics - counters since boot, exposed via the /metrics endpoint. Output
+// writes are counted under the output mutex, input reads by whichever of
+// the loop or the sample task is reading, everything else in the loop.
+uint32_t g_i2c_writes = 0;
+uint32_t g_i2c_write_errors = 0;
+uint32_t g_i2c_reads = 0;
+uint32_t g_i2c_read_errors = 0;
+uint32_t g_publish_successes = 0;
+uint32_t g_publish_failures = 0;
+uint32_t g_loop_passes = 0;
+uint32_t g_loop_last_us = 0;
+uint32_t g_loop_max_us = 0;
+uint64_t g_loop_total_us = 0;
+
+// Latency - command received to relay written, and input word read to
+// event published. Only ever updated from the loop.
+latencyHistogram_t g_latency[LATENCY_STAGES];
+uint32_t g_latency_start_us[LATENCY_STAGES];
+bool g_latency_active[LATENCY_STAGES];
+
+// Set via "latencyAlarmMs" integer config option (0 to disable)
+uint32_t g_latency_alarm_ms = DEFAULT_LATENCY_ALARM_MS;
+
+// Set via "idleSleepMs" and "idleCpuMhz" integer config options (0 to disable)
+uint32_t g_idle_sleep_ms = DEFAULT_IDLE_SLEEP_MS;
+uint32_t g_idle_cpu_mhz = 0;
+
+// Idle pacing state - only updated from the loop, other than the wake 
+// request from the pulse task when it has something to publish
+TaskHandle_t g_loop_task = NULL;
+volatile uint32_t g_idle_wake_us = 0;
+uint32_t g_idle_activity_ms = 0;
+bool g_idle_scaled = false;
+uint32_t g_idle_sleeps = 0;
+uint64_t g_idle_sleep_total_us = 0;
+uint32_t g_idle_wake_max_us = 0;
+uint64_t g_idle_wake_total_us = 0;
+
+// Set via "inputSampleHz" integer config option (0 to read inputs in the loop)
+uint32_t g_sample_hz = DEFAULT_INPUT_SAMPLE_HZ;
+
+// Input sampling - the timer ISR wakes the sample task, which queues 
+// samples for the loop. Stats are only written by the sample task, and
+// only accessed while holding the sample mux since the loop reads them
+// from the other core.
+hw_timer_t * g_sample_timer = NULL;
+TaskHandle_t g_sample_task = NULL;
+QueueHandle_t g_sample_queue = NULL;
+volatile uint32_t g_sample_period_us = 0;
+portMUX_TYPE g_sample_mux = portMUX_INITIALIZER_UNLOCKED;
+sampleStats_t g_sample_stats;
+
+// Set while the sample task is using Wire1, so the loop can wait for it
+// before reading the inputs itself. Only written while holding the mux.
+volatile bool g_sample_busy = false;
+
+// Bench state - a run is started by the /bench endpoint and then run a
+// slice at a time from the loop. The payload is only allocated while the
+// benchmark which needs it is running.
+benchState_t g_bench_state = BENCH_IDLE;
+uint8_t g_bench_index = 0;
+uint32_t g_bench_heap_free_bytes = 0;
+uint8_t * g_bench_payload = NULL;
+size_t g_bench_payload_length = 0;
+volatile uint32_t g_bench_sink = 0;
+debounce_t g_bench_debounce[PCF_COUNT];
+
+// Ethernet link state - updated by ethernetEvent()
+#if defined(ETHMODE)
+volatile bool g_eth_link_up = false;
+volatile bool g_eth_got_ip = false;
+#endif
+
+// Set via "directCommandTopics" boolean config option
+bool g_direct_commands = false;
+
+// MQTT topics - built once on connect rather than for every publish
+char g_mqtt_config_topic[64];
+char g_mqtt_command_topic[64];
+char g_mqtt_direct_topic[72];
+char g_mqtt_adopt_topic[64];
+char g_mqtt_status_topic[64];
+char g_mqtt_telemetry_topic[64];
+char g_mqtt_lwt_topic[64];
+
+// Set via "homeAssistantDiscovery" boolean and "homeAssistantPrefix" 
+// string config options
+bool g_hass_discovery = false;
+char g_hass_prefix[HASS_PREFIX_MAX_LEN + 1] = HASS_DEFAULT_PREFIX;
+
+// Entity last published for each output and input, as type + 1 so 0 
+// means nothing published. The generator only runs while something may 
+// have changed, and stops after a full lap with nothing to publish.
+uint8_t g_hass_outputs[CHANNEL_COUNT];
+uint8_t g_hass_inputs[CHANNEL_COUNT];
+uint16_t g_hass_cursor = 0;
+uint16_t g_hass_clean = 0;
+bool g_hass_pending = false;
+
 /*--------------------------- Instantiate Global Objects -----------------*/
 // I/O buffers
 Adafruit_PCF8575 pcf8575_DO[PCF_COUNT]; // Output - wire bus 0
@@ -116,13 +1070,22 @@ OXRS_Input oxrsInput[PCF_COUNT];
 // Output handlers
 OXRS_Output oxrsOutput[PCF_COUNT];
 
+// UDP event stream
+WiFiUDP udp;
+
+// WebSocket event stream
+WiFiServer wsServer(WS_PORT);
+
+// Input handler for benchmarking, so the real ones don't see simulated words
+OXRS_Input oxrsBenchInput;
+
 #if defined(ETHMODE)
-WiFiClient client;
+MqttConnectClient client;
 WiFiServer server(REST_API_PORT);
 #endif
 
 #if defined(WIFIMODE)
-WiFiClient client;
+MqttConnectClient client;
 WiFiServer server(REST_API_PORT);
 #endif
 
@@ -133,823 +1096,4441 @@ OXRS_MQTT mqtt(mqttClient);
 // REST API
 OXRS_API api(mqtt);
 
+// Output journal
+Preferences prefs;
+
 // Logging
 MqttLogger logger(mqttClient, "log", MqttLoggerMode::MqttAndSerial);
 
-/*--------------------------- Helpers -----------------*/
-uint8_t getMaxIndex()
+/*--------------------------- WebSocket events -----------------*/
+void closeWebSocket(wsClient_t * ws)
 {
-  // Count how many MCPs were found
-  uint8_t pcfCount = 0;
-  for (uint8_t pcf2 = 0; pcf2  < PCF_COUNT; pcf2 ++)
+  if (ws->state == WS_OPEN) { g_ws_clients_open--; }
+
+  ws->client.stop();
+  ws->state = WS_FREE;
+  ws->txLength = 0;
+  ws->rxLength = 0;
+}
+
+void evictWebSocket(wsClient_t * ws)
+{
+  logger.println(F("[stio] evicting slow websocket client"));
+  g_ws_evictions++;
+  closeWebSocket(ws);
+}
+
+bool flushWebSocket(wsClient_t * ws)
+{
+  // Never block the loop, send whatever the socket will take right now
+  if (ws->txLength == 0)
   {
-    if (bitRead(g_pcfs_found_di, pcf2) != 0) { pcfCount++; }
+    ws->progressMs = millis();
+    return true;
   }
 
-  // Remember our indexes are 1-based
-  return pcfCount * PCF_PIN_COUNT;  
+  int sent = send(ws->client.fd(), ws->tx, ws->txLength, MSG_DONTWAIT);
+  if (sent < 0)
+  {
+    if (errno == EWOULDBLOCK || errno == EAGAIN) { return true; }
+    closeWebSocket(ws);
+    return false;
+  }
+
+  if (sent > 0)
+  {
+    memmove(ws->tx, ws->tx + sent, ws->txLength - sent);
+    ws->txLength -= sent;
+    ws->progressMs = millis();
+  }
+  return true;
 }
 
-void getOutputType(char outputType[], uint8_t type)
+bool queueWebSocket(wsClient_t * ws, uint8_t opcode, const uint8_t * payload, uint16_t length)
 {
-  // Determine what type of output we have
-  sprintf_P(outputType, PSTR("error"));
-  switch (type)
+  // Server frames are never masked or fragmented
+  uint8_t header[4];
+  uint8_t headerLength = 2;
+  header[0] = 0x80 | opcode;
+  if (length < 126)
   {
-    case MOTOR:
-      sprintf_P(outputType, PSTR("motor"));
-      break;
-    case RELAY:
-      sprintf_P(outputType, PSTR("relay"));
-      break;
-    case TIMER:
-      sprintf_P(outputType, PSTR("timer"));
-      break;
+    header[1] = length;
+  }
+  else
+  {
+    header[1] = 126;
+    header[2] = length >> 8;
+    header[3] = length & 0xFF;
+    headerLength = 4;
+  }
+
+  // A client which has fallen this far behind isn't keeping up
+  if (ws->txLength + headerLength + length > WS_TX_BUFFER_SIZE)
+  {
+    evictWebSocket(ws);
+    return false;
   }
+
+  memcpy(ws->tx + ws->txLength, header, headerLength);
+  memcpy(ws->tx + ws->txLength + headerLength, payload, length);
+  ws->txLength += headerLength + length;
+  return flushWebSocket(ws);
 }
 
-void getOutputEventType(char eventType[], uint8_t type, uint8_t state)
+void sendWebSocketEvent(const char * kind, JsonVariant json)
 {
-  // Determine what event we need to publish
-  sprintf_P(eventType, PSTR("error"));
-  switch (state)
+  if (g_ws_clients_open == 0) { return; }
+
+  // Same as the MQTT event, wrapped so clients know inputs, outputs and scenes apart
+  char frame[WS_EVENT_MAX_LEN];
+  int length = sprintf_P(frame, PSTR("{\"%s\":"), kind);
+  length += serializeJson(json, frame + length, sizeof(frame) - length - 1);
+  frame[length++] = '}';
+
+  for (uint8_t i = 0; i < WS_MAX_CLIENTS; i++)
   {
-    case RELAY_ON:
-      sprintf_P(eventType, PSTR("on"));
-      break;
-    case RELAY_OFF:
-      sprintf_P(eventType, PSTR("off"));
-      break;
+    if (g_ws_clients[i].state != WS_OPEN)
+      continue;
+
+    queueWebSocket(&g_ws_clients[i], 0x1, (uint8_t *)frame, length);
   }
 }
 
-void getInputType(char inputType[], uint8_t type)
+void sendWebSocketSnapshot(wsClient_t * ws)
 {
-  // Determine what type of input we have
-  sprintf_P(inputType, PSTR("error"));
-  switch (type)
+  // The state of every output (1 = on) and input (raw level) as one 
+  // 16-bit word per board, so clients can render without waiting for events
+  StaticJsonDocument<512> json;
+  JsonObject snapshot = json.createNestedObject("snapshot");
+  snapshot["outputsPerMcp"] = g_pcf_output_pins;
+
+  JsonArray outputs = snapshot.createNestedArray("outputs");
+  JsonArray inputs = snapshot.createNestedArray("inputs");
+  for (uint8_t pcf = 0; pcf < PCF_COUNT; pcf++)
   {
-    case BUTTON:
-      sprintf_P(inputType, PSTR("button"));
-      break;
-    case CONTACT:
-      sprintf_P(inputType, PSTR("contact"));
-      break;
-    case PRESS:
-      sprintf_P(inputType, PSTR("press"));
-      break;
-    case ROTARY:
-      sprintf_P(inputType, PSTR("rotary"));
-      break;
-    case SECURITY:
-      sprintf_P(inputType, PSTR("security"));
-      break;
-    case SWITCH:
-      sprintf_P(inputType, PSTR("switch"));
-      break;
-    case TOGGLE:
-      sprintf_P(inputType, PSTR("toggle"));
-      break;
+    if (bitRead(g_pcfs_found_do, pcf))
+    {
+      uint16_t word = g_do_shadow[pcf];
+      outputs.add((uint16_t)(RELAY_ON == HIGH ? word : ~word));
+    }
+    else
+    {
+      outputs.add(nullptr);
+    }
+
+    if (bitRead(g_pcfs_found_di, pcf))
+    {
+      inputs.add(g_di_words[pcf]);
+    }
+    else
+    {
+      inputs.add(nullptr);
+    }
   }
+
+  char frame[384];
+  size_t length = serializeJson(json, frame, sizeof(frame));
+  queueWebSocket(ws, 0x1, (uint8_t *)frame, length);
 }
 
-void getInputEventType(char eventType[], uint8_t type, uint8_t state)
+bool getWebSocketAccept(const char * request, char accept[])
 {
-  // Determine what event we need to publish
-  sprintf_P(eventType, PSTR("error"));
-  switch (type)
+  // Find the key header, header names are case insensitive
+  const char * line = strstr(request, "\r\n");
+  while (line != NULL)
   {
-    case BUTTON:
-      switch (state)
-      {
-        case HOLD_EVENT:
-          sprintf_P(eventType, PSTR("hold"));
-          break;
-        case 1:
-          sprintf_P(eventType, PSTR("single"));
-          break;
-        case 2:
-          sprintf_P(eventType, PSTR("double"));
-          break;
-        case 3:
-          sprintf_P(eventType, PSTR("triple"));
-          break;
-        case 4:
-          sprintf_P(eventType, PSTR("quad"));
-          break;
-        case 5:
-          sprintf_P(eventType, PSTR("penta"));
-          break;
-      }
-      break;
-    case CONTACT:
-      switch (state)
-      {
-        case LOW_EVENT:
-          sprintf_P(eventType, PSTR("closed"));
-          break;
-        case HIGH_EVENT:
-          sprintf_P(eventType, PSTR("open"));
-          break;
-      }
-      break;
-    case PRESS:
-      sprintf_P(eventType, PSTR("press"));
-      break;
-    case ROTARY:
-      switch (state)
-      {
-        case LOW_EVENT:
-          sprintf_P(eventType, PSTR("up"));
-          break;
-        case HIGH_EVENT:
-          sprintf_P(eventType, PSTR("down"));
-          break;
-      }
-      break;
-    case SECURITY:
-      switch (state)
-      {
-        case HIGH_EVENT:
-          sprintf_P(eventType, PSTR("normal"));
-          break;
-        case LOW_EVENT:
-          sprintf_P(eventType, PSTR("alarm"));
-          break;
-        case TAMPER_EVENT:
-          sprintf_P(eventType, PSTR("tamper"));
-          break;
-        case SHORT_EVENT:
-          sprintf_P(eventType, PSTR("short"));
-          break;
-        case FAULT_EVENT:
-          sprintf_P(eventType, PSTR("fault"));
-          break;
-      }
-      break;
-    case SWITCH:
-      switch (state)
-      {
-        case LOW_EVENT:
-          sprintf_P(eventType, PSTR("on"));
-          break;
-        case HIGH_EVENT:
-          sprintf_P(eventType, PSTR("off"));
-          break;
-      }
-      break;
-    case TOGGLE:
-      sprintf_P(eventType, PSTR("toggle"));
+    line += 2;
+    if (strncasecmp(line, "Sec-WebSocket-Key:", 18) == 0)
       break;
+    line = strstr(line, "\r\n");
   }
-}
+  if (line == NULL) { return false; }
 
-uint8_t parseInputType(const char * inputType)
-{
-  if (strcmp(inputType, "button")   == 0) { return BUTTON; }
-  if (strcmp(inputType, "contact")  == 0) { return CONTACT; }
-  if (strcmp(inputType, "press")    == 0) { return PRESS; }
-  if (strcmp(inputType, "rotary")   == 0) { return ROTARY; }
-  if (strcmp(inputType, "security") == 0) { return SECURITY; }
-  if (strcmp(inputType, "switch")   == 0) { return SWITCH; }
-  if (strcmp(inputType, "toggle")   == 0) { return TOGGLE; }
+  const char * key = line + 18;
+  while (*key == ' ') { key++; }
+  const char * end = strstr(key, "\r\n");
+  if (end == NULL || end - key > 32) { return false; }
 
-  logger.println(F("[stio] invalid input type"));
-  return INVALID_INPUT_TYPE;
+  char keyGuid[80];
+  memcpy(keyGuid, key, end - key);
+  strcpy(keyGuid + (end - key), WS_GUID);
+
+  unsigned char sha1[20];
+  mbedtls_sha1_ret((const unsigned char *)keyGuid, strlen(keyGuid), sha1);
+
+  size_t length;
+  if (mbedtls_base64_encode((unsigned char *)accept, 32, &length, sha1, sizeof(sha1)) != 0) { return false; }
+  accept[length] = 0;
+  return true;
 }
 
-void setDefaultInputType(uint8_t inputType)
+void processWebSocketHandshake(wsClient_t * ws)
 {
-  // Set all pins on all MCPs to this default input type
-  for (uint8_t pcf2 = 0; pcf2 < PCF_COUNT; pcf2++)
+  // Stop at the end of the request. A client can send its first frames
+  // straight after it, which are left to be read into the rx buffer once
+  // the connection is open rather than lost with the request.
+  bool complete = false;
+  while (!complete && ws->client.available() && ws->txLength < WS_REQUEST_MAX_LEN)
   {
-    if (bitRead(g_pcfs_found_di, pcf2) == 0)
-      continue;
+    ws->tx[ws->txLength++] = ws->client.read();
+    complete = ws->txLength >= 4 && memcmp(&ws->tx[ws->txLength - 4], "\r\n\r\n", 4) == 0;
+  }
+  ws->tx[ws->txLength] = 0;
 
-    for (uint8_t pin2 = 0; pin2 < PCF_PIN_COUNT; pin2++)
+  char * request = (char *)ws->tx;
+  if (strstr(request, "\r\n\r\n") == NULL)
+  {
+    if (ws->txLength >= WS_REQUEST_MAX_LEN || (millis() - ws->progressMs) > WS_HANDSHAKE_TIMEOUT_MS)
     {
-      // Pass this update to the input handler
-      oxrsInput[pcf2].setType(pin2, inputType);
+      closeWebSocket(ws);
     }
+    return;
+  }
+
+  char accept[32];
+  if (!getWebSocketAccept(request, accept))
+  {
+    logger.println(F("[stio] invalid websocket request"));
+    closeWebSocket(ws);
+    return;
   }
+
+  ws->txLength = sprintf_P((char *)ws->tx, PSTR("HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\nConnection: Upgrade\r\nSec-WebSocket-Accept: %s\r\n\r\n"), accept);
+  ws->state = WS_OPEN;
+  g_ws_clients_open++;
+
+  if (flushWebSocket(ws)) { sendWebSocketSnapshot(ws); }
 }
 
-uint8_t getIndex(JsonVariant json)
+void processWebSocketFrames(wsClient_t * ws)
 {
-  if (!json.containsKey("index"))
+  while (ws->client.available() && ws->rxLength < WS_RX_BUFFER_SIZE)
   {
-    logger.println(F("[stio] missing index"));
-    return 0;
+    ws->rx[ws->rxLength++] = ws->client.read();
   }
-  
-  uint8_t index = json["index"].as<uint8_t>();
 
-  // Check the index is valid for this device
-  if (index <= 0 || index > getMaxIndex())
+  // We only expect small control frames from clients, always masked
+  while (ws->rxLength >= 6)
   {
-    logger.println(F("[stio] invalid index"));
-    return 0;
-  }
+    uint8_t opcode = ws->rx[0] & 0x0F;
+    uint8_t length = ws->rx[1] & 0x7F;
+    if (length > 125)
+    {
+      closeWebSocket(ws);
+      return;
+    }
 
-  return index;
+    uint8_t frameLength = 6 + length;
+    if (ws->rxLength < frameLength) { return; }
+
+    uint8_t * mask = &ws->rx[2];
+    uint8_t * payload = &ws->rx[6];
+    for (uint8_t i = 0; i < length; i++) { payload[i] ^= mask[i % 4]; }
+
+    if (opcode == 0x8)
+    {
+      closeWebSocket(ws);
+      return;
+    }
+
+    if (opcode == 0x9)
+    {
+      if (!queueWebSocket(ws, 0xA, payload, length)) { return; }
+    }
+
+    memmove(ws->rx, ws->rx + frameLength, ws->rxLength - frameLength);
+    ws->rxLength -= frameLength;
+  }
 }
 
-void setDefaultOutputType(uint8_t outputType)
+void processWebSockets()
 {
-  // Set all pins on all MCPs to this default output type
-  for (uint8_t pcf1 = 0; pcf1 < PCF_COUNT; pcf1++)
+  // Accept any new clients, turning them away if we are full
+  WiFiClient incoming = wsServer.available();
+  if (incoming)
   {
-    if (bitRead(g_pcfs_found_do, pcf1) == 0)
+    wsClient_t * ws = NULL;
+    for (uint8_t i = 0; i < WS_MAX_CLIENTS; i++)
+    {
+      if (g_ws_clients[i].state == WS_FREE) 
+      { 
+        ws = &g_ws_clients[i]; 
+        break; 
+      }
+    }
+
+    if (ws == NULL)
+    {
+      incoming.stop();
+    }
+    else
+    {
+      ws->client = incoming;
+      ws->state = WS_HANDSHAKE;
+      ws->progressMs = millis();
+      ws->txLength = 0;
+      ws->rxLength = 0;
+    }
+  }
+
+  for (uint8_t i = 0; i < WS_MAX_CLIENTS; i++)
+  {
+    wsClient_t * ws = &g_ws_clients[i];
+    if (ws->state == WS_FREE)
       continue;
 
-    for (uint8_t pin1 = 0; pin1 < g_pcf_output_pins; pin1++)
+    if (!ws->client.connected())
+    {
+      closeWebSocket(ws);
+      continue;
+    }
+
+    if (ws->state == WS_HANDSHAKE)
     {
-      oxrsOutput[pcf1].setType(pin1, outputType);
+      processWebSocketHandshake(ws);
+      continue;
+    }
+
+    processWebSocketFrames(ws);
+    if (ws->state != WS_OPEN || !flushWebSocket(ws))
+      continue;
+
+    // A client which hasn't taken anything for a while has stalled
+    if (ws->txLength > 0 && (millis() - ws->progressMs) > WS_STALL_TIMEOUT_MS)
+    {
+      evictWebSocket(ws);
     }
   }
 }
 
-uint8_t parseOutputType(const char * outputType)
+/*--------------------------- Idle pacing -----------------*/
+void markIdleActivity()
 {
-  if (strcmp(outputType, "relay") == 0) { return RELAY; }
-  if (strcmp(outputType, "motor") == 0) { return MOTOR; }
-  if (strcmp(outputType, "timer") == 0) { return TIMER; }
+  g_idle_activity_ms = millis();
 
-  logger.println(F("[stio] invalid output type"));
-  return INVALID_OUTPUT_TYPE;
+  // Back to full speed before handling whatever woke us
+  if (g_idle_scaled)
+  {
+    setCpuFrequencyMhz(FULL_CPU_MHZ);
+    g_idle_scaled = false;
+  }
 }
 
+void wakeIdleLoop()
+{
+  // Called from the pulse and sample tasks, cuts short any idle sleep
+  if (g_loop_task == NULL) { return; }
 
-void publishEventOutput(uint8_t index, uint8_t type, uint8_t state)
+  g_idle_wake_us = micros();
+  xTaskNotifyGive(g_loop_task);
+}
+
+uint32_t getIdleDeadlineMs(uint32_t deadlineMs, uint32_t now)
 {
-  char outputType[8];
-  getOutputType(outputType, type);
-  char eventType[7];
-  getOutputEventType(eventType, type, state);
+  int32_t remaining = (int32_t)(deadlineMs - now);
+  return remaining > 0 ? remaining : 0;
+}
 
-  StaticJsonDocument<64> json;
-  json["index"] = index;
-  json["type"] = outputType;
-  json["event"] = eventType;
-  
-  // TODO - Exit early if no network connection
-  // if (!isNetworkConnected()) {return;}
+uint32_t getIdleSleepMs(uint32_t now)
+{
+  if (g_idle_sleep_ms == 0) { return 0; }
 
-  boolean success = mqtt.publishStatus(json);
-  if (!success) 
+  // Stay awake while anything is, or has recently been, happening
+  if ((now - g_idle_activity_ms) < IDLE_HOLDOFF_MS) { return 0; }
+  if (g_hass_pending || g_capture_active || g_stall_unpublished || g_inputs_flooding > 0) { return 0; }
+
+  for (uint8_t pcf = 0; pcf < PCF_COUNT; pcf++)
   {
-    logger.print(F("[stio] [failover] "));
-    serializeJson(json, logger);
-    logger.println();
+    if (g_pulse_publish[pcf] != 0 || g_interlock_publish[pcf] != 0) { return 0; }
+  }
 
-    // TODO: add failover handling code here
+  for (uint8_t i = 0; i < WS_MAX_CLIENTS; i++)
+  {
+    if (g_ws_clients[i].state != WS_FREE && g_ws_clients[i].txLength > 0) { return 0; }
   }
-}
 
-void publishEventInput(uint8_t index, uint8_t type, uint8_t state)
-{
-  // Calculate the port and channel for this index (all 1-based)
-  uint8_t port = ((index - 1) / 4) + 1;
-  uint8_t channel = index - ((port - 1) * 4);
-  
-  char inputType[9];
-  getInputType(inputType, type);
-  char eventType[7];
-  getInputEventType(eventType, type, state);
+  // Never sleep past the next timed job. Input and output timers are
+  // polled, so are late by at most the sleep.
+  uint32_t sleepMs = g_idle_sleep_ms;
 
-  StaticJsonDocument<128> json;
-  json["port"] = port;
-  json["channel"] = channel;
-  json["index"] = index;
-  json["type"] = inputType;
-  json["event"] = eventType;
+  if (g_stats_interval_ms > 0)
+  {
+    sleepMs = min(sleepMs, getIdleDeadlineMs(g_stats_last_ms + g_stats_interval_ms, now));
+  }
 
-  // TODO - Exit early if no network connection
-  // if (!isNetworkConnected()) {return;}
+  if (g_interlock_making)
+  {
+    sleepMs = min(sleepMs, getIdleDeadlineMs(g_interlock_make_ms, now));
+  }
 
-  boolean success = mqtt.publishStatus(json);
-  if (!success) 
+  if (g_journal_pending)
   {
-    logger.print(F("[stio] [failover] "));
-    serializeJson(json, logger);
-    logger.println();
+    uint32_t quietMs = min(getIdleDeadlineMs(g_journal_change_ms + JOURNAL_QUIET_MS, now), getIdleDeadlineMs(g_journal_pending_ms + JOURNAL_MAX_DELAY_MS, now));
+    sleepMs = min(sleepMs, max(quietMs, getIdleDeadlineMs(g_journal_commit_ms + JOURNAL_MIN_INTERVAL_MS, now)));
+  }
 
-    // TODO: add failover handling code here
+  if (!mqttClient.connected())
+  {
+    sleepMs = min(sleepMs, getIdleDeadlineMs(g_mqtt_next_attempt_ms, now));
   }
+
+  return sleepMs;
 }
 
-/*--------------------------- JSON builders -----------------*/
-void getFirmwareJson(JsonVariant json)
+bool isNetworkReadable()
 {
-  JsonObject firmware = json.createNestedObject("firmware");
-
-  firmware["name"] = FW_NAME;
-  firmware["shortName"] = FW_SHORT_NAME;
-  firmware["maker"] = FW_MAKER;
-  firmware["version"] = STRINGIFY(FW_VERSION);
+  // Anything from the broker, a new REST or websocket connection, or a 
+  // frame from an open websocket. Polled as WiFiServer doesn't expose its
+  // listening sockets to select() on.
+  if (mqttClient.connected() && client.available()) { return true; }
+  if (server.hasClient() || wsServer.hasClient()) { return true; }
 
-#if defined(FW_GITHUB_URL)
-  firmware["githubUrl"] = FW_GITHUB_URL;
-#endif
+  for (uint8_t i = 0; i < WS_MAX_CLIENTS; i++)
+  {
+    if (g_ws_clients[i].state != WS_FREE && g_ws_clients[i].client.available()) { return true; }
+  }
+  return false;
 }
 
-void getSystemJson(JsonVariant json)
+void pauseIdleLoop()
 {
-  JsonObject system = json.createNestedObject("system");
+  uint32_t sleepMs = getIdleSleepMs(millis());
+  if (sleepMs == 0) { return; }
 
-  system["flashChipSizeBytes"] = ESP.getFlashChipSize();
-  system["heapFreeBytes"] = ESP.getFreeHeap();
-
-  system["heapUsedBytes"] = ESP.getHeapSize();
-  system["heapMaxAllocBytes"] = ESP.getMaxAllocHeap();
-
-  system["sketchSpaceUsedBytes"] = ESP.getSketchSize();
-  system["sketchSpaceTotalBytes"] = ESP.getFreeSketchSpace();
+  if (g_idle_cpu_mhz > 0 && !g_idle_scaled)
+  {
+    setCpuFrequencyMhz(g_idle_cpu_mhz);
+    g_idle_scaled = true;
+  }
 
-  system["fileSystemUsedBytes"] = LittleFS.usedBytes();
-  system["fileSystemTotalBytes"] = LittleFS.totalBytes();
+  // Sleep until the deadline, the pulse or sample task needs us, or
+  // something arrives over the network - checked every IDLE_POLL_MS so a
+  // command waits that long at most rather than the whole sleep. The
+  // supervisor doesn't count the sleep as part of the pass, and the pass 
+  // timer starts again once we are awake.
+  uint32_t startUs = micros();
+  g_loop_sleeping = true;
+  bool notified = false;
+  bool readable = false;
+  uint32_t sleptMs = 0;
+  while (!notified && !readable && sleptMs < sleepMs)
+  {
+    uint32_t sliceMs = min(sleepMs - sleptMs, (uint32_t)IDLE_POLL_MS);
+    notified = ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(sliceMs)) > 0;
+    readable = !notified && isNetworkReadable();
+    sleptMs += sliceMs;
+  }
+  g_loop_pass_start_ms = millis();
+  g_loop_sleeping = false;
+  uint32_t nowUs = micros();
+
+  // Wake latency is how long after the deadline, or the wake request, 
+  // we actually got to run again
+  uint32_t wakeUs = g_idle_wake_us;
+  uint32_t lateUs = 0;
+  if (notified && wakeUs != 0)
+  {
+    lateUs = nowUs - wakeUs;
+  }
+  else if (!readable && (nowUs - startUs) > sleepMs * 1000)
+  {
+    lateUs = (nowUs - startUs) - (sleepMs * 1000);
+  }
 
+  g_idle_sleeps++;
+  g_idle_sleep_total_us += nowUs - startUs;
+  g_idle_wake_total_us += lateUs;
+  if (lateUs > g_idle_wake_max_us) { g_idle_wake_max_us = lateUs; }
 }
 
-void getNetworkJson(JsonVariant json)
+/*--------------------------- Helpers -----------------*/
+bool isNetworkConnected()
 {
-  JsonObject network = json.createNestedObject("network");
-  
-  byte mac[6]; 
-
-  #if defined(ETHMODE)
-  network["mode"] = "ethernet";
-  network["ip"] = ETH.localIP();
-  network["mac"] = ETH.macAddress();
-
-  #elif defined(WIFIMODE)
-  network["mode"] = "wifi";
-  WiFi.macAddress(mac);
-  network["ip"] = WiFi.localIP();
-  #endif
-  
-  char mac_display[18];
-  sprintf_P(mac_display, PSTR("%02X:%02X:%02X:%02X:%02X:%02X"), mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
-  network["mac"] = mac_display;
+#if defined(ETHMODE)
+  return g_eth_link_up && g_eth_got_ip;
+#elif defined(WIFIMODE)
+  return WiFi.status() == WL_CONNECTED;
+#else
+  return false;
+#endif
 }
 
-void createOutputTypeEnum(JsonObject parent)
+// Calls fn(pcf) for each PCF with its bit set in found, lowest first,
+// only visiting the boards which were found
+template <typename Fn>
+inline void forEachPcf(uint8_t found, Fn fn)
 {
-  JsonArray typeEnum = parent.createNestedArray("enum");
-
-  typeEnum.add("relay");
-  typeEnum.add("motor");
-  typeEnum.add("timer");  
+  while (found != 0)
+  {
+    uint8_t pcf = __builtin_ctz(found);
+    found &= found - 1;
+    fn(pcf);
+  }
+}
+
+uint8_t getMaxIndex()
+{
+  // Count how many MCPs were found
+  uint8_t pcfCount = 0;
+  for (uint8_t pcf2 = 0; pcf2  < PCF_COUNT; pcf2 ++)
+  {
+    if (bitRead(g_pcfs_found_di, pcf2) != 0) { pcfCount++; }
+  }
+
+  // Remember our indexes are 1-based
+  return pcfCount * PCF_PIN_COUNT;  
+}
+
+uint8_t getMaxOutputIndex()
+{
+  // Output indexes are by position, so run up to the last output MCP found
+  // (which may not have an input MCP) at however many pins each is using
+  if (g_pcfs_found_do == 0) { return 0; }
+  uint8_t pcfCount = 32 - __builtin_clz((uint32_t)g_pcfs_found_do);
+  return pcfCount * g_pcf_output_pins;
+}
+
+void getOutputType(char outputType[], uint8_t type)
+{
+  // Determine what type of output we have
+  sprintf_P(outputType, PSTR("error"));
+  switch (type)
+  {
+    case MOTOR:
+      sprintf_P(outputType, PSTR("motor"));
+      break;
+    case RELAY:
+      sprintf_P(outputType, PSTR("relay"));
+      break;
+    case TIMER:
+      sprintf_P(outputType, PSTR("timer"));
+      break;
+    case PULSE:
+      sprintf_P(outputType, PSTR("pulse"));
+      break;
+  }
+}
+
+void getOutputEventType(char eventType[], uint8_t type, uint8_t state)
+{
+  // Determine what event we need to publish
+  sprintf_P(eventType, PSTR("error"));
+  switch (state)
+  {
+    case RELAY_ON:
+      sprintf_P(eventType, PSTR("on"));
+      break;
+    case RELAY_OFF:
+      sprintf_P(eventType, PSTR("off"));
+      break;
+  }
+}
+
+void getInputType(char inputType[], uint8_t type)
+{
+  // Determine what type of input we have
+  sprintf_P(inputType, PSTR("error"));
+  switch (type)
+  {
+    case BUTTON:
+      sprintf_P(inputType, PSTR("button"));
+      break;
+    case CONTACT:
+      sprintf_P(inputType, PSTR("contact"));
+      break;
+    case PRESS:
+      sprintf_P(inputType, PSTR("press"));
+      break;
+    case ROTARY:
+      sprintf_P(inputType, PSTR("rotary"));
+      break;
+    case SECURITY:
+      sprintf_P(inputType, PSTR("security"));
+      break;
+    case SWITCH:
+      sprintf_P(inputType, PSTR("switch"));
+      break;
+    case TOGGLE:
+      sprintf_P(inputType, PSTR("toggle"));
+      break;
+  }
+}
+
+void getInputEventType(char eventType[], uint8_t type, uint8_t state)
+{
+  // Determine what event we need to publish
+  sprintf_P(eventType, PSTR("error"));
+  if (state == FLOOD_EVENT)
+  {
+    sprintf_P(eventType, PSTR("flood"));
+    return;
+  }
+
+  switch (type)
+  {
+    case BUTTON:
+      switch (state)
+      {
+        case HOLD_EVENT:
+          sprintf_P(eventType, PSTR("hold"));
+          break;
+        case 1:
+          sprintf_P(eventType, PSTR("single"));
+          break;
+        case 2:
+          sprintf_P(eventType, PSTR("double"));
+          break;
+        case 3:
+          sprintf_P(eventType, PSTR("triple"));
+          break;
+        case 4:
+          sprintf_P(eventType, PSTR("quad"));
+          break;
+        case 5:
+          sprintf_P(eventType, PSTR("penta"));
+          break;
+      }
+      break;
+    case CONTACT:
+      switch (state)
+      {
+        case LOW_EVENT:
+          sprintf_P(eventType, PSTR("closed"));
+          break;
+        case HIGH_EVENT:
+          sprintf_P(eventType, PSTR("open"));
+          break;
+      }
+      break;
+    case PRESS:
+      sprintf_P(eventType, PSTR("press"));
+      break;
+    case ROTARY:
+      switch (state)
+      {
+        case LOW_EVENT:
+          sprintf_P(eventType, PSTR("up"));
+          break;
+        case HIGH_EVENT:
+          sprintf_P(eventType, PSTR("down"));
+          break;
+      }
+      break;
+    case SECURITY:
+      switch (state)
+      {
+        case HIGH_EVENT:
+          sprintf_P(eventType, PSTR("normal"));
+          break;
+        case LOW_EVENT:
+          sprintf_P(eventType, PSTR("alarm"));
+          break;
+        case TAMPER_EVENT:
+          sprintf_P(eventType, PSTR("tamper"));
+          break;
+        case SHORT_EVENT:
+          sprintf_P(eventType, PSTR("short"));
+          break;
+        case FAULT_EVENT:
+          sprintf_P(eventType, PSTR("fault"));
+          break;
+      }
+      break;
+    case SWITCH:
+      switch (state)
+      {
+        case LOW_EVENT:
+          sprintf_P(eventType, PSTR("on"));
+          break;
+        case HIGH_EVENT:
+          sprintf_P(eventType, PSTR("off"));
+          break;
+      }
+      break;
+    case TOGGLE:
+      sprintf_P(eventType, PSTR("toggle"));
+      break;
+  }
+}
+
+void getLoopPhase(char loopPhase[], uint8_t phase)
+{
+  // Determine which part of the loop was running
+  sprintf_P(loopPhase, PSTR("error"));
+  switch (phase)
+  {
+    case PHASE_LOOP:
+      sprintf_P(loopPhase, PSTR("loop"));
+      break;
+    case PHASE_MQTT:
+      sprintf_P(loopPhase, PSTR("mqtt"));
+      break;
+    case PHASE_API:
+      sprintf_P(loopPhase, PSTR("api"));
+      break;
+    case PHASE_OUTPUTS:
+      sprintf_P(loopPhase, PSTR("outputs"));
+      break;
+    case PHASE_INPUTS:
+      sprintf_P(loopPhase, PSTR("inputs"));
+      break;
+  }
+}
+
+void setLoopPhase(uint8_t phase)
+{
+  g_loop_phase_start_ms = millis();
+  g_loop_phase = phase;
+}
+
+uint8_t parseInputType(const char * inputType)
+{
+  if (strcmp(inputType, "button")   == 0) { return BUTTON; }
+  if (strcmp(inputType, "contact")  == 0) { return CONTACT; }
+  if (strcmp(inputType, "press")    == 0) { return PRESS; }
+  if (strcmp(inputType, "rotary")   == 0) { return ROTARY; }
+  if (strcmp(inputType, "security") == 0) { return SECURITY; }
+  if (strcmp(inputType, "switch")   == 0) { return SWITCH; }
+  if (strcmp(inputType, "toggle")   == 0) { return TOGGLE; }
+
+  logger.println(F("[stio] invalid input type"));
+  return INVALID_INPUT_TYPE;
+}
+
+void setDefaultInputType(uint8_t inputType)
+{
+  // Stage this default input type for all pins on all MCPs
+  for (uint8_t pcf2 = 0; pcf2 < PCF_COUNT; pcf2++)
+  {
+    if (bitRead(g_pcfs_found_di, pcf2) == 0)
+      continue;
+
+    for (uint8_t pin2 = 0; pin2 < PCF_PIN_COUNT; pin2++)
+    {
+      g_input_config_staging[pcf2][pin2].type = inputType;
+    }
+  }
+}
+
+uint8_t validateIndex(uint8_t index)
+{
+  // Check the index is valid for this device
+  if (index <= 0 || index > getMaxIndex())
+  {
+    logger.println(F("[stio] invalid index"));
+    return 0;
+  }
+
+  return index;
+}
+
+uint8_t getIndex(JsonVariant json)
+{
+  if (!json.containsKey("index"))
+  {
+    logger.println(F("[stio] missing index"));
+    return 0;
+  }
+  
+  return validateIndex(json["index"].as<uint8_t>());
+}
+
+void setOutputType(uint8_t pcf, uint8_t pin, uint8_t outputType)
+{
+  oxrsOutput[pcf].setType(pin, outputType);
+  bitWrite(g_pcf_relay_pins[pcf], pin, outputType == RELAY);
+}
+
+void setDefaultOutputType(uint8_t outputType)
+{
+  // Stage this default output type for all pins on all MCPs
+  for (uint8_t pcf1 = 0; pcf1 < PCF_COUNT; pcf1++)
+  {
+    if (bitRead(g_pcfs_found_do, pcf1) == 0)
+      continue;
+
+    for (uint8_t pin1 = 0; pin1 < g_pcf_output_pins; pin1++)
+    {
+      g_output_config_staging[pcf1][pin1].type = outputType;
+    }
+  }
+}
+
+uint8_t parseOutputType(const char * outputType)
+{
+  if (strcmp(outputType, "relay") == 0) { return RELAY; }
+  if (strcmp(outputType, "motor") == 0) { return MOTOR; }
+  if (strcmp(outputType, "timer") == 0) { return TIMER; }
+  if (strcmp(outputType, "pulse") == 0) { return PULSE; }
+
+  logger.println(F("[stio] invalid output type"));
+  return INVALID_OUTPUT_TYPE;
+}
+
+uint8_t getOutputState(uint8_t pcf, uint8_t pin)
+{
+  return bitRead(g_do_shadow[pcf], pin) ? HIGH : LOW;
+}
+
+float getChannelRate(channelStats_t * stats, uint32_t now)
+{
+  return stats->rate * expf(-(float)(now - stats->lastMs) / STATS_RATE_TAU_MS);
+}
+
+void updateChannelStats(channelStats_t * stats)
+{
+  uint32_t now = millis();
+  
+  // Exponentially decayed rate, in events per minute
+  stats->rate = getChannelRate(stats, now) + (60000.0f / STATS_RATE_TAU_MS);
+  stats->lastMs = now;
+  stats->count++;
+}
+
+void updateOutputStats(uint8_t pcf, uint16_t pins)
+{
+  while (pins != 0)
+  {
+    uint8_t pin = __builtin_ctz(pins);
+    pins &= pins - 1;
+
+    updateChannelStats(&g_output_stats[(g_pcf_output_pins * pcf) + pin]);
+  }
+}
+
+void startLatencyAt(uint8_t stage, uint32_t startUs)
+{
+  g_latency_start_us[stage] = startUs;
+  g_latency_active[stage] = true;
+}
+
+void startLatency(uint8_t stage)
+{
+  startLatencyAt(stage, micros());
+}
+
+void stopLatency(uint8_t stage)
+{
+  g_latency_active[stage] = false;
+}
+
+void recordLatency(uint8_t stage)
+{
+  // Only the first write (or publish) after the stage started counts
+  if (!g_latency_active[stage]) { return; }
+  g_latency_active[stage] = false;
+
+  uint32_t durationUs = micros() - g_latency_start_us[stage];
+  latencyHistogram_t * histogram = &g_latency[stage];
+
+  uint8_t bucket = durationUs < 2 ? 0 : min(31 - __builtin_clz(durationUs), LATENCY_BUCKETS - 1);
+  histogram->buckets[bucket]++;
+  histogram->count++;
+  histogram->totalUs += durationUs;
+  if (durationUs > histogram->maxUs) { histogram->maxUs = durationUs; }
+  if (g_latency_alarm_ms > 0 && durationUs > g_latency_alarm_ms * 1000) { histogram->exceeded++; }
+}
+
+uint32_t getLatencyPercentile(latencyHistogram_t * histogram, uint8_t percent)
+{
+  if (histogram->count == 0) { return 0; }
+
+  // Report the top of the bucket the percentile falls in, so we never 
+  // under-report, but no more than the longest sample
+  uint32_t target = (((uint64_t)histogram->count * percent) + 99) / 100;
+  uint32_t seen = 0;
+  for (uint8_t bucket = 0; bucket < LATENCY_BUCKETS - 1; bucket++)
+  {
+    seen += histogram->buckets[bucket];
+    if (seen >= target) { return min(1UL << (bucket + 1), (unsigned long)histogram->maxUs); }
+  }
+  return histogram->maxUs;
+}
+
+void resetLatency()
+{
+  memset(g_latency, 0, sizeof(g_latency));
+}
+
+uint16_t onPins(uint16_t word)
+{
+  return RELAY_ON == HIGH ? word : ~word;
+}
+
+uint16_t forceOff(uint16_t word, uint16_t pins)
+{
+  return RELAY_OFF == HIGH ? word | pins : word & ~pins;
+}
+
+void writeOutputWord(uint8_t pcf, uint16_t word)
+{
+  // Only call while holding the output mutex
+  g_do_shadow[pcf] = word;
+  g_i2c_writes++;
+  if (!pcf8575_DO[pcf].digitalWriteWord(word)) { g_i2c_write_errors++; }
+}
+
+uint16_t breakInterlocks(uint8_t pcf, uint16_t previous, uint16_t * pending)
+{
+  // Only call while holding the output mutex. Switches off everything in 
+  // the same group as any output about to be switched on. If anything had
+  // to break, those outputs are left off in the pending word and switched
+  // on by the loop once the interlock delay is up. Returns the pins on
+  // this PCF which were switched off and need publishing.
+  uint16_t switchedOn = onPins(*pending) & ~onPins(previous) & g_interlock_pins[pcf];
+  if (switchedOn == 0) { return 0; }
+
+  uint16_t breaking[PCF_COUNT];
+  memset(breaking, 0, sizeof(breaking));
+  uint16_t making = 0;
+
+  while (switchedOn != 0)
+  {
+    uint8_t pin = __builtin_ctz(switchedOn);
+    switchedOn &= switchedOn - 1;
+
+    // Another output in the same group won this write
+    if (bitRead(onPins(*pending), pin) == 0)
+      continue;
+
+    making |= 1 << pin;
+    interlockGroup_t * group = &g_interlock_groups[g_interlock_group_of[pcf][pin]];
+    for (uint8_t pcf1 = 0; pcf1 < PCF_COUNT; pcf1++)
+    {
+      // This output is newer than anything else in its group still
+      // waiting to make, so they don't get to switch on over it later
+      g_interlock_make[pcf1] &= ~group->mask[pcf1];
+      g_interlock_make_publish[pcf1] &= ~group->mask[pcf1];
+
+      if (pcf1 == pcf)
+      {
+        uint16_t conflicts = group->mask[pcf1] & onPins(*pending) & ~(1 << pin);
+        *pending = forceOff(*pending, conflicts);
+        breaking[pcf1] |= conflicts;
+      }
+      else
+      {
+        breaking[pcf1] |= group->mask[pcf1] & onPins(g_do_shadow[pcf1]);
+      }
+    }
+  }
+
+  // Break everything first. Only outputs which were actually on are
+  // published, not ones which lost a conflict within this write.
+  bool broken = false;
+  uint16_t published = 0;
+  for (uint8_t pcf1 = 0; pcf1 < PCF_COUNT; pcf1++)
+  {
+    if (breaking[pcf1] == 0 || bitRead(g_pcfs_found_do, pcf1) == 0)
+      continue;
+
+    uint16_t current = pcf1 == pcf ? previous : g_do_shadow[pcf1];
+    uint16_t wasOn = breaking[pcf1] & onPins(current);
+    g_interlock_publish[pcf1] |= wasOn;
+    if (pcf1 == pcf) { published = wasOn; }
+
+    if (wasOn != 0)
+    {
+      writeOutputWord(pcf1, forceOff(current, wasOn));
+      broken = true;
+    }
+  }
+
+  // Then leave the caller to make, now if nothing had to break, otherwise
+  // once the relays have had time to open
+  if (broken && g_interlock_delay_ms > 0)
+  {
+    *pending = forceOff(*pending, making);
+    g_interlock_make[pcf] |= making;
+    g_interlock_make_ms = millis() + g_interlock_delay_ms;
+    g_interlock_making = true;
+  }
+
+  return published;
+}
+
+uint16_t writeOutputs(uint8_t pcf, uint16_t mask, uint16_t value)
+{
+  // Update the shadow and write all 16 pins in a single transaction
+  xSemaphoreTake(g_do_mutex, portMAX_DELAY);
+  uint16_t previous = g_do_shadow[pcf];
+  uint16_t pending = (previous & ~mask) | (value & mask);
+
+  // Anything written now replaces an earlier switch on still waiting
+  g_interlock_make[pcf] &= ~mask;
+  g_interlock_make_publish[pcf] &= ~mask;
+
+  // Interlock groups are enforced against what is about to be written, so
+  // they hold however many outputs are being changed at once
+  uint16_t forced = breakInterlocks(pcf, previous, &pending);
+
+  writeOutputWord(pcf, pending);
+  uint16_t changed = (previous ^ pending) & ~forced;
+  xSemaphoreGive(g_do_mutex);
+
+  // Anything forced off is published (and counted) separately
+  return changed;
+}
+
+uint16_t switchOutputs(uint8_t pcf, uint16_t mask, uint16_t value)
+{
+  // Only call from the loop, since this updates the output stats
+  uint16_t changed = writeOutputs(pcf, mask, value);
+  updateOutputStats(pcf, changed);
+  recordLatency(LATENCY_COMMAND);
+  return changed;
+}
+
+void switchOutput(uint8_t pcf, uint8_t pin, uint8_t state)
+{
+  switchOutputs(pcf, 1 << pin, state == HIGH ? 0xFFFF : 0x0000);
+}
+
+bool readInputs(uint8_t pcf, uint16_t * value)
+{
+  // Read all 16 pins in a single transaction. Done directly on the bus,
+  // rather than via digitalReadWord(), so we know if the read failed.
+  g_i2c_reads++;
+  if (Wire1.requestFrom((uint16_t)PCF_I2C_ADDRESS[pcf], (uint8_t)2) != 2)
+  {
+    g_i2c_read_errors++;
+    return false;
+  }
+
+  uint8_t low = Wire1.read();
+  uint8_t high = Wire1.read();
+  *value = (high << 8) | low;
+  return true;
+}
+
+void countPublish(boolean success)
+{
+  if (success) { g_publish_successes++; } else { g_publish_failures++; }
+}
+
+void recordLoopDuration(uint32_t durationUs)
+{
+  g_loop_passes++;
+  g_loop_last_us = durationUs;
+  g_loop_total_us += durationUs;
+  if (durationUs > g_loop_max_us) { g_loop_max_us = durationUs; }
+}
+
+boolean publishJson(const char * topic, JsonVariant json, boolean retained)
+{
+  if (!isNetworkConnected() || !mqttClient.connected()) { return false; }
+
+  // Measure first so the payload can be streamed without buffering it, 
+  // which also means we are not limited by the PubSubClient buffer size
+  size_t length = measureJson(json);
+  if (!mqttClient.beginPublish(topic, length, retained)) 
+  { 
+    countPublish(false);
+    return false; 
+  }
+
+  MqttStream stream(mqttClient);
+  serializeJson(json, stream);
+  stream.flush();
+
+  boolean success = mqttClient.endPublish() && stream.written() == length;
+  countPublish(success);
+  return success;
+}
+
+boolean publishStatus(JsonVariant json)
+{
+  return publishJson(g_mqtt_status_topic, json, false);
+}
+
+boolean publishTelemetry(JsonVariant json)
+{
+  return publishJson(g_mqtt_telemetry_topic, json, false);
+}
+
+boolean publishAdopt(JsonVariant json)
+{
+  return publishJson(g_mqtt_adopt_topic, json, true);
+}
+
+void getOutputEventJson(JsonVariant json, uint8_t index, uint8_t type, uint8_t state)
+{
+  char outputType[8];
+  getOutputType(outputType, type);
+  char eventType[7];
+  getOutputEventType(eventType, type, state);
+
+  json["index"] = index;
+  json["type"] = outputType;
+  json["event"] = eventType;
+}
+
+void getInputEventJson(JsonVariant json, uint8_t index, uint8_t type, uint8_t state, uint16_t suppressed)
+{
+  // Calculate the port and channel for this index (all 1-based)
+  uint8_t port = ((index - 1) / 4) + 1;
+  uint8_t channel = index - ((port - 1) * 4);
+  
+  char inputType[9];
+  getInputType(inputType, type);
+  char eventType[7];
+  getInputEventType(eventType, type, state);
+
+  json["port"] = port;
+  json["channel"] = channel;
+  json["index"] = index;
+  json["type"] = inputType;
+  json["event"] = eventType;
+
+  // Summary of a rate limited input
+  if (suppressed > 0)
+  {
+    json["suppressed"] = suppressed;
+  }
+}
+
+void sendUdpEvent(uint8_t kind, uint8_t index, uint8_t type, uint8_t state, uint16_t suppressed)
+{
+  if (!g_udp_events || !isNetworkConnected()) { return; }
+
+  udpEventRecord_t record;
+  record.magic = UDP_EVENT_MAGIC;
+  record.version = UDP_EVENT_VERSION;
+  record.kind = kind;
+  record.sequence = g_udp_event_sequence++;
+  record.ms = millis();
+  record.index = index;
+  record.type = type;
+  record.state = state;
+  record.reserved = 0;
+  record.suppressed = suppressed;
+
+  // Fire and forget, a failed send shows up as a gap in the sequence
+  if (!udp.beginPacket(g_udp_event_ip, g_udp_event_port) || 
+      udp.write((uint8_t *)&record, sizeof(record)) != sizeof(record) || 
+      !udp.endPacket())
+  {
+    g_udp_event_failures++;
+  }
+}
+
+void publishEvent(const char * kind, JsonVariant json)
+{
+  sendWebSocketEvent(kind, json);
+
+  boolean success = publishStatus(json);
+  if (!success) 
+  {
+    logger.print(F("[stio] [failover] "));
+    serializeJson(json, logger);
+    logger.println();
+
+    // TODO: add failover handling code here
+  }
+}
+
+void publishEventOutput(uint8_t index, uint8_t type, uint8_t state)
+{
+  markIdleActivity();
+
+  // UDP first, it is the low latency path
+  sendUdpEvent(UDP_EVENT_OUTPUT, index, type, state, 0);
+
+  StaticJsonDocument<64> json;
+  getOutputEventJson(json.as<JsonVariant>(), index, type, state);
+  publishEvent("output", json.as<JsonVariant>());
+}
+
+void publishEventInput(uint8_t index, uint8_t type, uint8_t state, uint16_t suppressed = 0)
+{
+  markIdleActivity();
+
+  // UDP first, it is the low latency path
+  sendUdpEvent(UDP_EVENT_INPUT, index, type, state, suppressed);
+
+  StaticJsonDocument<128> json;
+  getInputEventJson(json.as<JsonVariant>(), index, type, state, suppressed);
+  publishEvent("input", json.as<JsonVariant>());
+  recordLatency(LATENCY_INPUT);
+}
+
+/*--------------------------- Pulse outputs -----------------*/
+void IRAM_ATTR pulseTimerISR()
+{
+  bool expired = false;
+
+  portENTER_CRITICAL_ISR(&g_pulse_mux);
+  for (uint8_t i = 0; i < PULSE_MAX_ACTIVE; i++)
+  {
+    if (g_pulses[i].active && g_pulses[i].remainingMs > 0)
+    {
+      if (--g_pulses[i].remainingMs == 0) { expired = true; }
+    }
+  }
+  portEXIT_CRITICAL_ISR(&g_pulse_mux);
+
+  // Can't do I2C from an ISR so hand off to the pulse task
+  if (expired)
+  {
+    BaseType_t woken = pdFALSE;
+    vTaskNotifyGiveFromISR(g_pulse_task, &woken);
+    portYIELD_FROM_ISR(woken);
+  }
+}
+
+bool pulsesActive()
+{
+  for (uint8_t i = 0; i < PULSE_MAX_ACTIVE; i++)
+  {
+    if (g_pulses[i].active) { return true; }
+  }
+  return false;
+}
+
+void expirePulses()
+{
+  // Switch off any pulse the timer has counted down to zero
+  bool anyActive = false;
+  for (uint8_t i = 0; i < PULSE_MAX_ACTIVE; i++)
+  {
+    // Claim the slot before switching anything off, so a pulse which was
+    // re-triggered since the timer expired it is left running
+    portENTER_CRITICAL(&g_pulse_mux);
+    bool expired = g_pulses[i].active && g_pulses[i].remainingMs == 0;
+    if (expired) { g_pulses[i].active = false; }
+    if (g_pulses[i].active) { anyActive = true; }
+    uint8_t pcf = g_pulses[i].pcf;
+    uint8_t pin = g_pulses[i].pin;
+    portEXIT_CRITICAL(&g_pulse_mux);
+
+    if (!expired)
+      continue;
+
+    writeOutputs(pcf, 1 << pin, RELAY_OFF == HIGH ? 0xFFFF : 0x0000);
+
+    // Publishing (and stats) are left to the loop
+    portENTER_CRITICAL(&g_pulse_mux);
+    g_pulse_publish[pcf] |= (1 << pin);
+    portEXIT_CRITICAL(&g_pulse_mux);
+    wakeIdleLoop();
+  }
+
+  if (!anyActive)
+  {
+    timerAlarmDisable(g_pulse_timer);
+
+    // A pulse may have been started while we were checking
+    if (pulsesActive()) { timerAlarmEnable(g_pulse_timer); }
+  }
+}
+
+void pulseTask(void * param)
+{
+  for (;;)
+  {
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    expirePulses();
+  }
+}
+
+void startPulse(uint8_t pcf, uint8_t pin)
+{
+  // A zero length pulse would never be counted down, and never turn off
+  uint16_t pulseMs = g_pulse_ms[pcf][pin];
+  if (pulseMs == 0) { pulseMs = DEFAULT_PULSE_MS; }
+
+  int8_t slot = -1;
+
+  portENTER_CRITICAL(&g_pulse_mux);
+  for (uint8_t i = 0; i < PULSE_MAX_ACTIVE; i++)
+  {
+    // Re-triggering a pulse in progress restarts it
+    if (g_pulses[i].active && g_pulses[i].pcf == pcf && g_pulses[i].pin == pin)
+    {
+      slot = i;
+      break;
+    }
+    if (!g_pulses[i].active && slot == -1) { slot = i; }
+  }
+
+  if (slot != -1)
+  {
+    g_pulses[slot].pcf = pcf;
+    g_pulses[slot].pin = pin;
+    g_pulses[slot].remainingMs = pulseMs;
+  }
+  portEXIT_CRITICAL(&g_pulse_mux);
+
+  if (slot == -1)
+  {
+    logger.println(F("[stio] too many pulses in progress"));
+    return;
+  }
+
+  switchOutput(pcf, pin, RELAY_ON);
+
+  // Only start counting down once the output is on
+  portENTER_CRITICAL(&g_pulse_mux);
+  g_pulses[slot].active = true;
+  portEXIT_CRITICAL(&g_pulse_mux);
+  timerAlarmEnable(g_pulse_timer);
+
+  publishEventOutput((g_pcf_output_pins * pcf) + pin + 1, PULSE, RELAY_ON);
+}
+
+void stopPulse(uint8_t pcf, uint8_t pin)
+{
+  portENTER_CRITICAL(&g_pulse_mux);
+  for (uint8_t i = 0; i < PULSE_MAX_ACTIVE; i++)
+  {
+    if (g_pulses[i].active && g_pulses[i].pcf == pcf && g_pulses[i].pin == pin)
+    {
+      g_pulses[i].active = false;
+    }
+  }
+  portEXIT_CRITICAL(&g_pulse_mux);
+
+  switchOutput(pcf, pin, RELAY_OFF);
+  publishEventOutput((g_pcf_output_pins * pcf) + pin + 1, PULSE, RELAY_OFF);
+}
+
+void publishPulses()
+{
+  forEachPcf(g_pcfs_found_do, [](uint8_t pcf)
+  {
+    if (g_pulse_publish[pcf] == 0)
+      return;
+
+    portENTER_CRITICAL(&g_pulse_mux);
+    uint16_t pins = g_pulse_publish[pcf];
+    g_pulse_publish[pcf] = 0;
+    portEXIT_CRITICAL(&g_pulse_mux);
+
+    updateOutputStats(pcf, pins);
+
+    for (uint8_t pin = 0; pin < PCF_PIN_COUNT; pin++)
+    {
+      if (bitRead(pins, pin) == 0)
+        continue;
+
+      publishEventOutput((g_pcf_output_pins * pcf) + pin + 1, PULSE, RELAY_OFF);
+    }
+  });
+}
+
+void initialisePulses()
+{
+  for (uint8_t pcf = 0; pcf < PCF_COUNT; pcf++)
+  {
+    for (uint8_t pin = 0; pin < PCF_PIN_COUNT; pin++)
+    {
+      g_pulse_ms[pcf][pin] = DEFAULT_PULSE_MS;
+    }
+  }
+
+  xTaskCreatePinnedToCore(pulseTask, "pulse", PULSE_TASK_STACK_SIZE, NULL, PULSE_TASK_PRIORITY, &g_pulse_task, SUPERVISOR_CORE);
+
+  // 1MHz timer, ticking every 1ms while any pulse is in progress
+  g_pulse_timer = timerBegin(PULSE_TIMER_NUM, 80, true);
+  timerAttachInterrupt(g_pulse_timer, &pulseTimerISR, true);
+  timerAlarmWrite(g_pulse_timer, PULSE_TICK_US, true);
+}
+
+/*--------------------------- Interlock groups -----------------*/
+void publishInterlocks()
+{
+  forEachPcf(g_pcfs_found_do, [](uint8_t pcf)
+  {
+    if (g_interlock_publish[pcf] == 0)
+      return;
+
+    xSemaphoreTake(g_do_mutex, portMAX_DELAY);
+    uint16_t pins = g_interlock_publish[pcf];
+    g_interlock_publish[pcf] = 0;
+    xSemaphoreGive(g_do_mutex);
+
+    updateOutputStats(pcf, pins);
+
+    while (pins != 0)
+    {
+      uint8_t pin = __builtin_ctz(pins);
+      pins &= pins - 1;
+
+      publishEventOutput((g_pcf_output_pins * pcf) + pin + 1, oxrsOutput[pcf].getType(pin), RELAY_OFF);
+    }
+  });
+}
+
+void processInterlockMakes()
+{
+  // Switch on anything which was waiting for the rest of its group to 
+  // break. This goes through the interlocks again, in case another output
+  // in the group has been switched on since.
+  if (!g_interlock_making)
+    return;
+
+  uint16_t making[PCF_COUNT];
+  uint16_t publish[PCF_COUNT];
+  xSemaphoreTake(g_do_mutex, portMAX_DELAY);
+  bool due = (int32_t)(millis() - g_interlock_make_ms) >= 0;
+  if (due)
+  {
+    memcpy(making, g_interlock_make, sizeof(making));
+    memcpy(publish, g_interlock_make_publish, sizeof(publish));
+    memset(g_interlock_make, 0, sizeof(g_interlock_make));
+    memset(g_interlock_make_publish, 0, sizeof(g_interlock_make_publish));
+    g_interlock_making = false;
+  }
+  xSemaphoreGive(g_do_mutex);
+
+  if (!due)
+    return;
+
+  for (uint8_t pcf = 0; pcf < PCF_COUNT; pcf++)
+  {
+    if (making[pcf] == 0 || bitRead(g_pcfs_found_do, pcf) == 0)
+      continue;
+
+    // Only now are they on, so this is when their on events go out
+    uint16_t made = switchOutputs(pcf, making[pcf], RELAY_ON == HIGH ? 0xFFFF : 0x0000) & publish[pcf];
+    while (made != 0)
+    {
+      uint8_t pin = __builtin_ctz(made);
+      made &= made - 1;
+
+      publishEventOutput((g_pcf_output_pins * pcf) + pin + 1, oxrsOutput[pcf].getType(pin), RELAY_ON);
+    }
+  }
+}
+
+bool deferInterlockEvent(uint8_t pcf, uint8_t pin)
+{
+  // An output held back by its interlock group publishes its on event
+  // when it actually makes, rather than now
+  xSemaphoreTake(g_do_mutex, portMAX_DELAY);
+  bool deferred = bitRead(g_interlock_make[pcf], pin);
+  if (deferred) { bitSet(g_interlock_make_publish[pcf], pin); }
+  xSemaphoreGive(g_do_mutex);
+  return deferred;
+}
+
+void applyInterlockGroups(interlockGroup_t * groups, uint8_t count)
+{
+  xSemaphoreTake(g_do_mutex, portMAX_DELAY);
+
+  memcpy(g_interlock_groups, groups, count * sizeof(interlockGroup_t));
+  g_interlock_group_count = count;
+
+  // Rebuild the lookups used on every write
+  memset(g_interlock_pins, 0, sizeof(g_interlock_pins));
+  for (uint8_t group = 0; group < count; group++)
+  {
+    for (uint8_t pcf = 0; pcf < PCF_COUNT; pcf++)
+    {
+      uint16_t pins = groups[group].mask[pcf];
+      g_interlock_pins[pcf] |= pins;
+
+      while (pins != 0)
+      {
+        g_interlock_group_of[pcf][__builtin_ctz(pins)] = group;
+        pins &= pins - 1;
+      }
+    }
+  }
+
+  // Only the first output of a group which is already on stays on
+  for (uint8_t group = 0; group < count; group++)
+  {
+    bool found = false;
+    for (uint8_t pcf = 0; pcf < PCF_COUNT; pcf++)
+    {
+      if (bitRead(g_pcfs_found_do, pcf) == 0)
+        continue;
+
+      uint16_t on = groups[group].mask[pcf] & onPins(g_do_shadow[pcf]);
+      if (on != 0 && !found)
+      {
+        on &= on - 1;
+        found = true;
+      }
+
+      if (on == 0)
+        continue;
+
+      writeOutputWord(pcf, forceOff(g_do_shadow[pcf], on));
+      g_interlock_publish[pcf] |= on;
+    }
+  }
+
+  xSemaphoreGive(g_do_mutex);
+}
+
+/*--------------------------- Output journal -----------------*/
+void initialiseJournal()
+{
+  prefs.begin(JOURNAL_NAMESPACE, false);
+
+  // Anything missing or from a different layout means nothing to restore
+  memset(&g_journal, 0, sizeof(journal_t));
+  if (prefs.getBytesLength(JOURNAL_KEY) == sizeof(journal_t))
+  {
+    prefs.getBytes(JOURNAL_KEY, &g_journal, sizeof(journal_t));
+  }
+
+  // The restore config is reloaded with the rest of the config later,
+  // until then restore whatever was journalled
+  memcpy(g_pcf_restore_pins, g_journal.mask, sizeof(g_pcf_restore_pins));
+}
+
+uint16_t getRestoredOutputs(uint8_t pcf)
+{
+  uint16_t off = RELAY_OFF == HIGH ? 0xFFFF : 0x0000;
+  return (off & ~g_journal.mask[pcf]) | (g_journal.state[pcf] & g_journal.mask[pcf]);
+}
+
+void processJournal()
+{
+  uint32_t now = millis();
+
+  // Only relays are restored, anything timed would never turn back off
+  journal_t journal;
+  for (uint8_t pcf = 0; pcf < PCF_COUNT; pcf++)
+  {
+    journal.mask[pcf] = g_pcf_restore_pins[pcf] & g_pcf_relay_pins[pcf];
+    journal.state[pcf] = g_do_shadow[pcf] & journal.mask[pcf];
+  }
+
+  if (memcmp(&journal, &g_journal, sizeof(journal_t)) == 0)
+  {
+    g_journal_pending = false;
+    return;
+  }
+
+  // Track when this change started, and when outputs last changed
+  if (!g_journal_pending)
+  {
+    g_journal_pending = true;
+    g_journal_pending_ms = now;
+  }
+  
+  static journal_t s_last;
+  if (memcmp(&journal, &s_last, sizeof(journal_t)) != 0)
+  {
+    memcpy(&s_last, &journal, sizeof(journal_t));
+    g_journal_change_ms = now;
+  }
+
+  // Coalesce changes to keep flash wear bounded
+  if ((now - g_journal_commit_ms) < JOURNAL_MIN_INTERVAL_MS) { return; }
+  if ((now - g_journal_change_ms) < JOURNAL_QUIET_MS && (now - g_journal_pending_ms) < JOURNAL_MAX_DELAY_MS) { return; }
+
+  prefs.putBytes(JOURNAL_KEY, &journal, sizeof(journal_t));
+  memcpy(&g_journal, &journal, sizeof(journal_t));
+  g_journal_pending = false;
+  g_journal_commit_ms = now;
+}
+
+/*--------------------------- Capture -----------------*/
+const uint32_t CAPTURE_RING_SIZE = ((CAPTURE_FILE_SIZE - sizeof(captureHeader_t)) / sizeof(captureRecord_t)) * sizeof(captureRecord_t);
+
+void flushCapture()
+{
+  if (g_capture_buffered == 0) { return; }
+
+  File file = LittleFS.open(CAPTURE_FILE, "r+");
+  if (!file)
+  {
+    logger.println(F("[stio] failed to open capture file, stopping capture"));
+    g_capture_active = false;
+    g_capture_buffered = 0;
+    return;
+  }
+
+  // Append to the ring, wrapping back to the start when full
+  uint8_t written = 0;
+  while (written < g_capture_buffered)
+  {
+    uint32_t space = (CAPTURE_RING_SIZE - g_capture_header.head) / sizeof(captureRecord_t);
+    uint8_t count = min((uint32_t)(g_capture_buffered - written), space);
+
+    file.seek(sizeof(captureHeader_t) + g_capture_header.head);
+    file.write((uint8_t *)&g_capture_buffer[written], count * sizeof(captureRecord_t));
+    written += count;
+
+    g_capture_header.head += count * sizeof(captureRecord_t);
+    if (g_capture_header.head >= CAPTURE_RING_SIZE)
+    {
+      g_capture_header.head = 0;
+      g_capture_header.wrapped = 1;
+    }
+  }
+
+  file.seek(0);
+  file.write((uint8_t *)&g_capture_header, sizeof(captureHeader_t));
+  file.close();
+
+  g_capture_buffered = 0;
+  g_capture_flush_ms = millis();
+}
+
+void captureRecord(uint8_t kind, uint8_t id, uint16_t value)
+{
+  captureRecord_t * record = &g_capture_buffer[g_capture_buffered++];
+  record->ms = millis();
+  record->kind = kind;
+  record->id = id;
+  record->value = value;
+
+  if (g_capture_buffered == CAPTURE_BUFFER_RECORDS) { flushCapture(); }
+}
+
+void captureInput(uint8_t pcf, uint16_t value)
+{
+  if (!g_capture_active) { return; }
+
+  // Only record changes, the previous word holds until then
+  if (bitRead(g_capture_pcfs_seen, pcf) && g_capture_last_word[pcf] == value) { return; }
+
+  bitSet(g_capture_pcfs_seen, pcf);
+  g_capture_last_word[pcf] = value;
+  captureRecord(CAPTURE_INPUT, pcf, value);
+}
+
+void captureOutput(uint8_t index, uint8_t state)
+{
+  if (!g_capture_active) { return; }
+  captureRecord(CAPTURE_OUTPUT, index - 1, state);
+}
+
+void captureScene(uint8_t scene)
+{
+  if (!g_capture_active) { return; }
+  captureRecord(CAPTURE_SCENE, scene, 0);
+}
+
+void startCapture()
+{
+  File file = LittleFS.open(CAPTURE_FILE, "w");
+  if (!file)
+  {
+    logger.println(F("[stio] failed to create capture file"));
+    return;
+  }
+
+  g_capture_header.magic = CAPTURE_MAGIC;
+  g_capture_header.head = 0;
+  g_capture_header.wrapped = 0;
+  file.write((uint8_t *)&g_capture_header, sizeof(captureHeader_t));
+  file.close();
+
+  // Make sure the first sample from every PCF is recorded
+  g_capture_pcfs_seen = 0;
+  g_capture_buffered = 0;
+  g_capture_flush_ms = millis();
+  g_capture_active = true;
+
+  logger.println(F("[stio] capture started"));
+}
+
+void stopCapture()
+{
+  if (!g_capture_active) { return; }
+
+  flushCapture();
+  g_capture_active = false;
+
+  logger.println(F("[stio] capture stopped"));
+}
+
+void processCapture()
+{
+  // Flush periodically so a quiet capture still makes it to flash
+  if (g_capture_active && (millis() - g_capture_flush_ms) >= CAPTURE_FLUSH_MS)
+  {
+    flushCapture();
+  }
+}
+
+/*--------------------------- Scenes -----------------*/
+scene_t * findScene(const char * name)
+{
+  for (uint8_t i = 0; i < g_scene_count; i++)
+  {
+    if (strcmp(g_scenes[i].name, name) == 0) { return &g_scenes[i]; }
+  }
+  return NULL;
+}
+
+bool compileScene(JsonVariant json, scene_t * scene)
+{
+  if (!json.containsKey("name") || json["name"].isNull())
+  {
+    logger.println(F("[stio] missing scene name"));
+    return false;
+  }
+
+  memset(scene, 0, sizeof(scene_t));
+  strncpy(scene->name, json["name"], SCENE_NAME_MAX_LEN);
+
+  for (JsonVariant output : json["outputs"].as<JsonArray>())
+  {
+    uint8_t index = getIndex(output);
+    if (index == 0) continue;
+
+    uint8_t pcf = (index - 1) / g_pcf_output_pins;
+    uint8_t pin = (index - 1) % g_pcf_output_pins;
+
+    uint8_t state;
+    if (output["state"].isNull())
+    {
+      logger.println(F("[stio] missing scene state"));
+      continue;
+    }
+    else if (strcmp(output["state"], "on") == 0)
+    {
+      state = RELAY_ON;
+    }
+    else if (strcmp(output["state"], "off") == 0)
+    {
+      state = RELAY_OFF;
+    }
+    else
+    {
+      logger.println(F("[stio] invalid scene state"));
+      continue;
+    }
+
+    bitSet(scene->mask[pcf], pin);
+    bitWrite(scene->value[pcf], pin, state == HIGH);
+  }
+
+  // Honour interlocks by turning off anything locked with an output the
+  // scene turns on, so recalling a scene is still a single write
+  for (uint8_t pcf = 0; pcf < PCF_COUNT; pcf++)
+  {
+    for (uint8_t pin = 0; pin < PCF_PIN_COUNT; pin++)
+    {
+      if (bitRead(scene->mask[pcf], pin) == 0 || bitRead(scene->value[pcf], pin) != (RELAY_ON == HIGH))
+        continue;
+
+      // Scenes arrive with the config, so check against any staged interlocks
+      uint8_t lock = g_config_staging ? g_output_config_staging[pcf][pin].interlock : g_output_config[pcf][pin].interlock;
+      if (lock == pin)
+        continue;
+
+      if (bitRead(scene->mask[pcf], lock) && bitRead(scene->value[pcf], lock) == (RELAY_ON == HIGH))
+      {
+        logger.println(F("[stio] scene turns on interlocked outputs"));
+        return false;
+      }
+
+      bitSet(scene->mask[pcf], lock);
+      bitWrite(scene->value[pcf], lock, RELAY_OFF == HIGH);
+    }
+  }
+
+  // Same for interlock groups, where only one output can be turned on
+  for (uint8_t group = 0; group < g_interlock_group_count; group++)
+  {
+    uint8_t on = 0;
+    for (uint8_t pcf = 0; pcf < PCF_COUNT; pcf++)
+    {
+      on += __builtin_popcount(g_interlock_groups[group].mask[pcf] & scene->mask[pcf] & onPins(scene->value[pcf]));
+    }
+
+    if (on > 1)
+    {
+      logger.println(F("[stio] scene turns on interlocked outputs"));
+      return false;
+    }
+
+    if (on == 0)
+      continue;
+
+    for (uint8_t pcf = 0; pcf < PCF_COUNT; pcf++)
+    {
+      uint16_t others = g_interlock_groups[group].mask[pcf] & ~(scene->mask[pcf] & onPins(scene->value[pcf]));
+      scene->mask[pcf] |= others;
+      scene->value[pcf] = forceOff(scene->value[pcf], others);
+    }
+  }
+
+  return true;
+}
+
+void saveScenes()
+{
+  File file = LittleFS.open(SCENES_FILE, "w");
+  if (!file)
+  {
+    logger.println(F("[stio] failed to save scenes"));
+    return;
+  }
+
+  // Store the PCF count so we never load scenes built for another layout
+  uint8_t header[2] = { PCF_COUNT, g_scene_count };
+  file.write(header, sizeof(header));
+  file.write((uint8_t *)g_scenes, g_scene_count * sizeof(scene_t));
+  file.close();
+}
+
+void loadScenes()
+{
+  if (!LittleFS.exists(SCENES_FILE)) { return; }
+
+  File file = LittleFS.open(SCENES_FILE, "r");
+  if (!file) { return; }
+
+  uint8_t header[2];
+  if (file.read(header, sizeof(header)) != sizeof(header) || header[0] != PCF_COUNT || header[1] > SCENE_MAX_COUNT)
+  {
+    logger.println(F("[stio] invalid scenes file"));
+    file.close();
+    return;
+  }
+
+  size_t size = header[1] * sizeof(scene_t);
+  if (file.read((uint8_t *)g_scenes, size) == size)
+  {
+    g_scene_count = header[1];
+  }
+  file.close();
+}
+
+void recallScene(const char * name)
+{
+  scene_t * scene = findScene(name);
+  if (scene == NULL)
+  {
+    logger.println(F("[stio] invalid scene"));
+    return;
+  }
+
+  captureScene(scene - g_scenes);
+
+  uint8_t count = 0;
+  for (uint8_t pcf = 0; pcf < PCF_COUNT; pcf++)
+  {
+    if (bitRead(g_pcfs_found_do, pcf) == 0)
+      continue;
+
+    uint16_t mask = scene->mask[pcf];
+    if (mask == 0)
+      continue;
+
+    // Relays are written directly, a single word for the whole board
+    uint16_t direct = mask & g_pcf_relay_pins[pcf];
+    if (direct != 0)
+    {
+      switchOutputs(pcf, direct, scene->value[pcf]);
+    }
+
+    // Anything else (timers, motors, pulses) needs its output handler
+    uint16_t handled = mask & ~direct;
+    while (handled != 0)
+    {
+      uint8_t pin = __builtin_ctz(handled);
+      handled &= handled - 1;
+
+      uint8_t state = bitRead(scene->value[pcf], pin) ? HIGH : LOW;
+      if (oxrsOutput[pcf].getType(pin) == PULSE)
+      {
+        if (state == RELAY_ON) { startPulse(pcf, pin); } else { stopPulse(pcf, pin); }
+      }
+      else
+      {
+        oxrsOutput[pcf].handleCommand(pcf, pin, state);
+      }
+    }
+
+    count += __builtin_popcount(mask);
+  }
+
+  // Publish a single summary event rather than one per output
+  StaticJsonDocument<96> json;
+  json["scene"] = scene->name;
+  json["event"] = "recall";
+  json["outputs"] = count;
+
+  publishEvent("scene", json.as<JsonVariant>());
+}
+
+/*--------------------------- Input debounce -----------------*/
+uint16_t debounceWord(debounce_t * debounce, uint16_t sample)
+{
+  // Any pin which differs from the debounced state counts up, anything 
+  // else is reset. A pin only changes state once its counter wraps.
+  uint16_t delta = sample ^ debounce->state;
+  debounce->count1 = (debounce->count1 ^ debounce->count0) & delta;
+  debounce->count0 = ~debounce->count0 & delta;
+  debounce->state ^= delta & ~(debounce->count0 | debounce->count1);
+  return debounce->state;
+}
+
+uint16_t debounceInputs(uint8_t pcf, uint16_t sample, uint32_t now)
+{
+  debounce_t * debounce = &g_input_debounce[pcf];
+
+  if (!debounce->primed)
+  {
+    debounce->state = sample;
+    debounce->primed = true;
+  }
+
+  // Not debouncing, but keep the state current so turning debounce on
+  // later starts from the word as it is now
+  if (debounce->tickMs == 0)
+  {
+    debounce->state = sample;
+    return sample;
+  }
+
+  // Only sample once per tick, so the debounce time doesn't depend on 
+  // how fast the loop is running
+  if ((now - debounce->lastMs) < debounce->tickMs) { return debounce->state; }
+  debounce->lastMs = now;
+
+  return debounceWord(debounce, sample);
+}
+
+void setInputDebounce(uint8_t pcf, uint16_t debounceMs)
+{
+  debounce_t * debounce = &g_input_debounce[pcf];
+
+  // Round up, so we never debounce for less than asked
+  uint16_t tickMs = (min(debounceMs, (uint16_t)MAX_INPUT_DEBOUNCE_MS) + DEBOUNCE_TICKS - 1) / DEBOUNCE_TICKS;
+  if (tickMs == debounce->tickMs) { return; }
+
+  // Start again from the next sample rather than whatever state was
+  // left from before
+  debounce->tickMs = tickMs;
+  debounce->count0 = 0;
+  debounce->count1 = 0;
+  debounce->primed = false;
+}
+
+/*--------------------------- Input rate limiting -----------------*/
+void resetInputLimiter(uint8_t index, uint8_t rateLimit)
+{
+  inputLimiter_t * limiter = &g_input_limiters[index - 1];
+
+  if (limiter->flooding) { g_inputs_flooding--; }
+
+  memset(limiter, 0, sizeof(inputLimiter_t));
+  limiter->rateLimit = rateLimit;
+  limiter->tokens = rateLimit * INPUT_BURST_SECONDS * 1000L;
+  limiter->lastMs = millis();
+}
+
+bool allowInputEvent(uint8_t index, uint8_t type, uint8_t state)
+{
+  inputLimiter_t * limiter = &g_input_limiters[index - 1];
+  if (limiter->rateLimit == 0) { return true; }
+
+  // Refill the bucket - rateLimit events/sec is rateLimit 1/1000ths per ms
+  uint32_t now = millis();
+  uint32_t elapsedMs = min(now - limiter->lastMs, (uint32_t)(INPUT_BURST_SECONDS * 1000L));
+  uint32_t burst = limiter->rateLimit * INPUT_BURST_SECONDS * 1000L;
+  limiter->tokens = min(limiter->tokens + (elapsedMs * limiter->rateLimit), burst);
+  limiter->lastMs = now;
+  limiter->events++;
+
+  // Healthy inputs just spend a token
+  if (!limiter->flooding && limiter->tokens >= 1000)
+  {
+    limiter->tokens -= 1000;
+    return true;
+  }
+
+  // Otherwise coalesce into a periodic summary
+  limiter->lastType = type;
+  limiter->lastState = state;
+  limiter->suppressed++;
+
+  if (!limiter->flooding)
+  {
+    limiter->flooding = true;
+    limiter->events = 1;
+    g_inputs_flooding++;
+
+    // Raise a fault so whoever is watching knows events are being dropped
+    publishEventInput(index, type, FLOOD_EVENT);
+  }
+
+  return false;
+}
+
+void processInputLimiters()
+{
+  // Nothing to do unless an input is flooding
+  if (g_inputs_flooding == 0) { return; }
+  if ((millis() - g_input_summary_ms) < INPUT_SUMMARY_MS) { return; }
+  g_input_summary_ms = millis();
+
+  for (uint8_t i = 0; i < CHANNEL_COUNT; i++)
+  {
+    inputLimiter_t * limiter = &g_input_limiters[i];
+    if (!limiter->flooding)
+      continue;
+
+    // Publish the last state and how many events were dropped
+    if (limiter->suppressed > 0)
+    {
+      publishEventInput(i + 1, limiter->lastType, limiter->lastState, limiter->suppressed);
+    }
+
+    // Stop flooding once the input is back within its rate limit
+    if (limiter->events <= (limiter->rateLimit * INPUT_SUMMARY_MS / 1000))
+    {
+      limiter->flooding = false;
+      g_inputs_flooding--;
+    }
+
+    limiter->events = 0;
+    limiter->suppressed = 0;
+  }
+}
+
+/*--------------------------- Input sampling -----------------*/
+void processInputWord(uint8_t pcf, uint16_t value, uint32_t sampleMs, uint32_t sampleUs)
+{
+  // Changing, or still bouncing, inputs keep the loop awake
+  if (value != g_di_words[pcf]) { markIdleActivity(); }
+
+  captureInput(pcf, value);
+
+  // Only stable words are passed on to the input handlers
+  value = debounceInputs(pcf, value, sampleMs);
+  g_di_words[pcf] = value;
+
+  // Check for any input events, timing from the read to the publish
+  startLatencyAt(LATENCY_INPUT, sampleUs);
+  oxrsInput[pcf].process(pcf, value);
+  stopLatency(LATENCY_INPUT);
+}
+
+void processInputSamples()
+{
+  // Drain everything queued since the last pass, oldest first
+  inputSample_t sample;
+  while (xQueueReceive(g_sample_queue, &sample, 0) == pdTRUE)
+  {
+    forEachPcf(sample.read, [&sample](uint8_t pcf)
+    {
+      processInputWord(pcf, sample.words[pcf], sample.ms, sample.us);
+    });
+  }
+}
+
+void IRAM_ATTR sampleTimerISR()
+{
+  // Can't do I2C from an ISR so hand off to the sample task
+  BaseType_t woken = pdFALSE;
+  vTaskNotifyGiveFromISR(g_sample_task, &woken);
+  portYIELD_FROM_ISR(woken);
+}
+
+void sampleTask(void * param)
+{
+  uint32_t lastUs = 0;
+  inputSample_t sample;
+  memset(&sample, 0, sizeof(sample));
+
+  for (;;)
+  {
+    // More than one tick waiting means we missed a deadline
+    uint32_t ticks = ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    uint32_t nowUs = micros();
+
+    // Claim the bus in the same step as checking we are still sampling,
+    // so sampling can't be switched off in between
+    portENTER_CRITICAL(&g_sample_mux);
+    uint32_t periodUs = g_sample_period_us;
+    g_sample_busy = periodUs != 0;
+    portEXIT_CRITICAL(&g_sample_mux);
+
+    if (periodUs == 0)
+    {
+      lastUs = 0;
+      continue;
+    }
+
+    // Jitter is how far each sample is from a whole number of periods 
+    // after the last one
+    uint32_t jitterUs = 0;
+    if (lastUs != 0)
+    {
+      uint32_t intervalUs = nowUs - lastUs;
+      uint32_t expectedUs = periodUs * ticks;
+      jitterUs = intervalUs > expectedUs ? intervalUs - expectedUs : expectedUs - intervalUs;
+    }
+    lastUs = nowUs;
+
+    uint8_t previousRead = sample.read;
+    uint16_t previous[PCF_COUNT];
+    memcpy(previous, sample.words, sizeof(previous));
+
+    sample.ms = millis();
+    sample.us = nowUs;
+    sample.read = 0;
+    for (uint8_t pcf = 0; pcf < PCF_COUNT; pcf++)
+    {
+      if (bitRead(g_pcfs_found_di, pcf) == 0)
+        continue;
+
+      if (readInputs(pcf, &sample.words[pcf])) { bitSet(sample.read, pcf); }
+    }
+
+    bool dropped = xQueueSend(g_sample_queue, &sample, 0) != pdTRUE;
+
+    portENTER_CRITICAL(&g_sample_mux);
+    g_sample_stats.samples++;
+    if (ticks > 1) { g_sample_stats.missed += ticks - 1; }
+    if (dropped) { g_sample_stats.dropped++; }
+    g_sample_stats.jitterTotalUs += jitterUs;
+    if (jitterUs > g_sample_stats.jitterMaxUs) { g_sample_stats.jitterMaxUs = jitterUs; }
+    g_sample_busy = false;
+    portEXIT_CRITICAL(&g_sample_mux);
+
+    // Don't leave a change sitting in the queue while the loop is idle
+    if (sample.read != previousRead || memcmp(previous, sample.words, sizeof(previous)) != 0)
+    {
+      wakeIdleLoop();
+    }
+  }
+}
+
+void getSampleStats(sampleStats_t * stats)
+{
+  // A consistent copy, the 64-bit total can't be read in one go
+  portENTER_CRITICAL(&g_sample_mux);
+  *stats = g_sample_stats;
+  portEXIT_CRITICAL(&g_sample_mux);
+}
+
+void setInputSampleRate(uint32_t hz)
+{
+  if (hz == g_sample_hz) { return; }
+
+  timerAlarmDisable(g_sample_timer);
+
+  g_sample_hz = hz;
+  portENTER_CRITICAL(&g_sample_mux);
+  g_sample_period_us = hz == 0 ? 0 : 1000000L / hz;
+  portEXIT_CRITICAL(&g_sample_mux);
+
+  if (hz == 0)
+  {
+    // The loop reads the inputs from the next pass, so wait for any
+    // sample already in progress to finish with Wire1 first
+    while (g_sample_busy) { vTaskDelay(1); }
+    return;
+  }
+
+  timerAlarmWrite(g_sample_timer, g_sample_period_us, true);
+  timerAlarmEnable(g_sample_timer);
+}
+
+void initialiseSampling()
+{
+  g_sample_queue = xQueueCreate(SAMPLE_QUEUE_LENGTH, sizeof(inputSample_t));
+
+  xTaskCreatePinnedToCore(sampleTask, "sample", SAMPLE_TASK_STACK_SIZE, NULL, SAMPLE_TASK_PRIORITY, &g_sample_task, SUPERVISOR_CORE);
+
+  // 1MHz timer, only enabled while sampling at a fixed rate
+  g_sample_timer = timerBegin(SAMPLE_TIMER_NUM, 80, true);
+  timerAttachInterrupt(g_sample_timer, &sampleTimerISR, true);
+}
+
+/*--------------------------- JSON builders -----------------*/
+void getFirmwareJson(JsonVariant json)
+{
+  JsonObject firmware = json.createNestedObject("firmware");
+
+  firmware["name"] = FW_NAME;
+  firmware["shortName"] = FW_SHORT_NAME;
+  firmware["maker"] = FW_MAKER;
+  firmware["version"] = STRINGIFY(FW_VERSION);
+
+#if defined(FW_GITHUB_URL)
+  firmware["githubUrl"] = FW_GITHUB_URL;
+#endif
+}
+
+void getSystemJson(JsonVariant json)
+{
+  JsonObject system = json.createNestedObject("system");
+
+  system["flashChipSizeBytes"] = ESP.getFlashChipSize();
+  system["heapFreeBytes"] = ESP.getFreeHeap();
+
+  system["heapUsedBytes"] = ESP.getHeapSize();
+  system["heapMaxAllocBytes"] = ESP.getMaxAllocHeap();
+
+  system["sketchSpaceUsedBytes"] = ESP.getSketchSize();
+  system["sketchSpaceTotalBytes"] = ESP.getFreeSketchSpace();
+
+  system["fileSystemUsedBytes"] = LittleFS.usedBytes();
+  system["fileSystemTotalBytes"] = LittleFS.totalBytes();
+
+}
+
+void getStallsJson(JsonVariant json, bool unpublishedOnly)
+{
+  // Take a copy so we don't hold the supervisor off while building json
+  stallRecord_t stalls[STALL_RECORD_COUNT];
+  uint8_t head, count;
+
+  portENTER_CRITICAL(&g_stall_mux);
+  memcpy(stalls, g_stalls, sizeof(stalls));
+  head = g_stall_head;
+  count = g_stall_count;
+  portEXIT_CRITICAL(&g_stall_mux);
+
+  JsonArray array = json.createNestedArray("stalls");
+
+  // Oldest first
+  for (uint8_t i = 0; i < count; i++)
+  {
+    stallRecord_t * stall = &stalls[(head + STALL_RECORD_COUNT - count + i) % STALL_RECORD_COUNT];
+    if (unpublishedOnly && stall->published)
+      continue;
+
+    char loopPhase[8];
+    getLoopPhase(loopPhase, stall->phase);
+
+    JsonObject record = array.createNestedObject();
+    record["phase"] = loopPhase;
+    record["durationMs"] = stall->durationMs;
+    record["uptimeMs"] = stall->uptimeMs;
+  }
+}
+
+void getConnectionJson(JsonVariant json)
+{
+  JsonObject connection = json.createNestedObject("connection");
+
+  connection["networkConnected"] = isNetworkConnected();
+  connection["mqttConnected"] = mqttClient.connected();
+  connection["connects"] = g_mqtt_connects;
+  connection["attempts"] = g_mqtt_total_attempts;
+  connection["connectingMs"] = g_mqtt_total_connecting_ms;
+  connection["backoffMs"] = g_mqtt_backoff_ms;
+}
+
+void writeChannelStatsJson(Print & out, channelStats_t * stats, uint8_t count, uint32_t now)
+{
+  out.print(F("{\"counts\":["));
+  for (uint8_t i = 0; i < count; i++)
+  {
+    if (i > 0) { out.print(','); }
+    out.print(stats[i].count);
+  }
+
+  out.print(F("],\"rates\":["));
+  for (uint8_t i = 0; i < count; i++)
+  {
+    if (i > 0) { out.print(','); }
+    out.print(getChannelRate(&stats[i], now), 1);
+  }
+  out.print(F("]}"));
+}
+
+void writeStatsJson(Print & out, uint32_t now, const sampleStats_t & sampling)
+{
+  // Written directly rather than via a json document - at 128 channels
+  // this is far too big to build in memory for a periodic publish
+  out.print(F("{\"stats\":{\"inputs\":"));
+  writeChannelStatsJson(out, g_input_stats, getMaxIndex(), now);
+  out.print(F(",\"outputs\":"));
+  writeChannelStatsJson(out, g_output_stats, getMaxOutputIndex(), now);
+  out.print('}');
+
+  if (g_sample_hz > 0)
+  {
+    out.print(F(",\"sampling\":{\"hz\":"));
+    out.print(g_sample_hz);
+    out.print(F(",\"samples\":"));
+    out.print(sampling.samples);
+    out.print(F(",\"missed\":"));
+    out.print(sampling.missed);
+    out.print(F(",\"dropped\":"));
+    out.print(sampling.dropped);
+    out.print(F(",\"jitterMeanUs\":"));
+    out.print(sampling.samples < 2 ? 0 : (uint32_t)(sampling.jitterTotalUs / (sampling.samples - 1)));
+    out.print(F(",\"jitterMaxUs\":"));
+    out.print(sampling.jitterMaxUs);
+    out.print('}');
+  }
+
+  out.print('}');
+}
+
+void writeMetricHeader(Print & out, const char * name, const char * type, const char * help)
+{
+  out.print(F("# HELP "));
+  out.print(name);
+  out.print(' ');
+  out.print(help);
+  out.print(F("\n# TYPE "));
+  out.print(name);
+  out.print(' ');
+  out.print(type);
+  out.print('\n');
+}
+
+void writeMetricSample(Print & out, const char * name, const char * labels, double value, uint8_t digits)
+{
+  out.print(name);
+  if (labels) 
+  { 
+    out.print('{'); 
+    out.print(labels); 
+    out.print('}'); 
+  }
+  out.print(' ');
+  out.print(value, digits);
+  out.print('\n');
+}
+
+void writeMetric(Print & out, const char * name, const char * type, const char * help, double value, uint8_t digits = 0)
+{
+  writeMetricHeader(out, name, type, help);
+  writeMetricSample(out, name, NULL, value, digits);
+}
+
+void writeLatencyMetrics(Print & out, const char * stage, latencyHistogram_t * histogram)
+{
+  char labels[48];
+  uint32_t cumulative = 0;
+
+  for (uint8_t bucket = 0; bucket < LATENCY_BUCKETS; bucket++)
+  {
+    cumulative += histogram->buckets[bucket];
+
+    if (bucket == LATENCY_BUCKETS - 1)
+    {
+      sprintf_P(labels, PSTR("%s,le=\"+Inf\""), stage);
+    }
+    else
+    {
+      sprintf_P(labels, PSTR("%s,le=\"%.6f\""), stage, (1UL << (bucket + 1)) / 1000000.0);
+    }
+    writeMetricSample(out, PSTR("stio_latency_seconds_bucket"), labels, cumulative, 0);
+  }
+
+  writeMetricSample(out, PSTR("stio_latency_seconds_sum"), stage, histogram->totalUs / 1000000.0, 6);
+  writeMetricSample(out, PSTR("stio_latency_seconds_count"), stage, histogram->count, 0);
+}
+
+void writeMetrics(Print & out)
+{
+  // Prometheus text exposition format, written straight to the output
+  writeMetric(out, PSTR("stio_uptime_seconds"), PSTR("gauge"), PSTR("Time since boot."), millis() / 1000.0, 3);
+
+  writeMetric(out, PSTR("stio_heap_free_bytes"), PSTR("gauge"), PSTR("Free heap."), ESP.getFreeHeap());
+  writeMetric(out, PSTR("stio_heap_min_free_bytes"), PSTR("gauge"), PSTR("Lowest free heap since boot."), ESP.getMinFreeHeap());
+  writeMetric(out, PSTR("stio_heap_max_alloc_bytes"), PSTR("gauge"), PSTR("Largest heap block that can be allocated."), ESP.getMaxAllocHeap());
+
+  writeMetricHeader(out, PSTR("stio_loop_duration_seconds"), PSTR("summary"), PSTR("Duration of each pass of the main loop."));
+  writeMetricSample(out, PSTR("stio_loop_duration_seconds_sum"), NULL, g_loop_total_us / 1000000.0, 6);
+  writeMetricSample(out, PSTR("stio_loop_duration_seconds_count"), NULL, g_loop_passes, 0);
+  writeMetric(out, PSTR("stio_loop_duration_last_seconds"), PSTR("gauge"), PSTR("Duration of the last pass of the main loop."), g_loop_last_us / 1000000.0, 6);
+  writeMetric(out, PSTR("stio_loop_duration_max_seconds"), PSTR("gauge"), PSTR("Longest pass of the main loop since boot."), g_loop_max_us / 1000000.0, 6);
+
+  // Duty cycle is the share of loop time spent running rather than idle
+  uint64_t loopTotalUs = g_loop_total_us + g_idle_sleep_total_us;
+  writeMetric(out, PSTR("stio_loop_duty_cycle"), PSTR("gauge"), PSTR("Fraction of time since boot the main loop was running rather than idle."), loopTotalUs == 0 ? 1.0 : (double)g_loop_total_us / loopTotalUs, 4);
+  writeMetric(out, PSTR("stio_idle_sleeps_total"), PSTR("counter"), PSTR("Idle sleeps between passes of the main loop."), g_idle_sleeps);
+  writeMetric(out, PSTR("stio_idle_sleep_seconds_total"), PSTR("counter"), PSTR("Time spent in idle sleeps."), g_idle_sleep_total_us / 1000000.0, 6);
+  writeMetric(out, PSTR("stio_idle_wake_latency_seconds_total"), PSTR("counter"), PSTR("Time from each idle deadline, or wake request, until the loop ran again."), g_idle_wake_total_us / 1000000.0, 6);
+  writeMetric(out, PSTR("stio_idle_wake_latency_max_seconds"), PSTR("gauge"), PSTR("Longest idle wake latency since boot."), g_idle_wake_max_us / 1000000.0, 6);
+  writeMetric(out, PSTR("stio_cpu_frequency_mhz"), PSTR("gauge"), PSTR("Current CPU clock."), getCpuFrequencyMhz());
+
+  writeMetricHeader(out, PSTR("stio_latency_seconds"), PSTR("histogram"), PSTR("Command received to output written, and input read to event published."));
+  writeLatencyMetrics(out, PSTR("stage=\"command\""), &g_latency[LATENCY_COMMAND]);
+  writeLatencyMetrics(out, PSTR("stage=\"input\""), &g_latency[LATENCY_INPUT]);
+
+  sampleStats_t sampling;
+  getSampleStats(&sampling);
+  writeMetric(out, PSTR("stio_input_sample_rate_hz"), PSTR("gauge"), PSTR("Fixed input sample rate, 0 when inputs are read by the main loop."), g_sample_hz);
+  writeMetric(out, PSTR("stio_input_samples_total"), PSTR("counter"), PSTR("Input samples taken by the sample timer."), sampling.samples);
+  writeMetric(out, PSTR("stio_input_sample_missed_total"), PSTR("counter"), PSTR("Sample timer deadlines missed because the previous sample was still running."), sampling.missed);
+  writeMetric(out, PSTR("stio_input_sample_dropped_total"), PSTR("counter"), PSTR("Input samples dropped because the queue to the main loop was full."), sampling.dropped);
+  writeMetric(out, PSTR("stio_input_sample_queued"), PSTR("gauge"), PSTR("Input samples waiting for the main loop."), uxQueueMessagesWaiting(g_sample_queue));
+  writeMetric(out, PSTR("stio_input_sample_jitter_seconds_total"), PSTR("counter"), PSTR("Total deviation of each sample from its expected time."), sampling.jitterTotalUs / 1000000.0, 6);
+  writeMetric(out, PSTR("stio_input_sample_jitter_max_seconds"), PSTR("gauge"), PSTR("Largest deviation of a sample from its expected time."), sampling.jitterMaxUs / 1000000.0, 6);
+
+  writeMetricHeader(out, PSTR("stio_i2c_transactions_total"), PSTR("counter"), PSTR("I2C transactions with the PCF8575s."));
+  writeMetricSample(out, PSTR("stio_i2c_transactions_total"), PSTR("op=\"read\""), g_i2c_reads, 0);
+  writeMetricSample(out, PSTR("stio_i2c_transactions_total"), PSTR("op=\"write\""), g_i2c_writes, 0);
+  writeMetricHeader(out, PSTR("stio_i2c_errors_total"), PSTR("counter"), PSTR("Failed I2C transactions with the PCF8575s."));
+  writeMetricSample(out, PSTR("stio_i2c_errors_total"), PSTR("op=\"read\""), g_i2c_read_errors, 0);
+  writeMetricSample(out, PSTR("stio_i2c_errors_total"), PSTR("op=\"write\""), g_i2c_write_errors, 0);
+
+  writeMetricHeader(out, PSTR("stio_mqtt_publishes_total"), PSTR("counter"), PSTR("MQTT publishes attempted."));
+  writeMetricSample(out, PSTR("stio_mqtt_publishes_total"), PSTR("result=\"success\""), g_publish_successes, 0);
+  writeMetricSample(out, PSTR("stio_mqtt_publishes_total"), PSTR("result=\"failure\""), g_publish_failures, 0);
+  writeMetric(out, PSTR("stio_udp_events_total"), PSTR("counter"), PSTR("Events sent on the udp event stream."), g_udp_event_sequence);
+  writeMetric(out, PSTR("stio_udp_event_failures_total"), PSTR("counter"), PSTR("Events which failed to send on the udp event stream."), g_udp_event_failures);
+  writeMetric(out, PSTR("stio_websocket_clients"), PSTR("gauge"), PSTR("WebSocket clients connected."), g_ws_clients_open);
+  writeMetric(out, PSTR("stio_websocket_evictions_total"), PSTR("counter"), PSTR("WebSocket clients evicted for not keeping up."), g_ws_evictions);
+  writeMetric(out, PSTR("stio_mqtt_connected"), PSTR("gauge"), PSTR("Whether the MQTT broker is connected."), mqttClient.connected() ? 1 : 0);
+  writeMetric(out, PSTR("stio_mqtt_connects_total"), PSTR("counter"), PSTR("MQTT broker connections since boot."), g_mqtt_connects);
+
+  writeMetricHeader(out, PSTR("stio_pcfs_found"), PSTR("gauge"), PSTR("PCF8575s found on the I2C buses at boot."));
+  writeMetricSample(out, PSTR("stio_pcfs_found"), PSTR("role=\"output\""), __builtin_popcount(g_pcfs_found_do), 0);
+  writeMetricSample(out, PSTR("stio_pcfs_found"), PSTR("role=\"input\""), __builtin_popcount(g_pcfs_found_di), 0);
+}
+
+void getLatencyStageJson(JsonObject json, latencyHistogram_t * histogram)
+{
+  json["count"] = histogram->count;
+  json["meanUs"] = histogram->count == 0 ? 0 : (uint32_t)(histogram->totalUs / histogram->count);
+  json["p50Us"] = getLatencyPercentile(histogram, 50);
+  json["p90Us"] = getLatencyPercentile(histogram, 90);
+  json["p99Us"] = getLatencyPercentile(histogram, 99);
+  json["maxUs"] = histogram->maxUs;
+  json["exceeded"] = histogram->exceeded;
+}
+
+bool getLatencyJson(JsonVariant json)
+{
+  JsonObject latency = json.createNestedObject("latency");
+  latency["alarmMs"] = g_latency_alarm_ms;
+
+  getLatencyStageJson(latency.createNestedObject("command"), &g_latency[LATENCY_COMMAND]);
+  getLatencyStageJson(latency.createNestedObject("input"), &g_latency[LATENCY_INPUT]);
+
+  // Regressed if the p99 of any stage is over the alarm threshold
+  bool ok = true;
+  for (uint8_t stage = 0; stage < LATENCY_STAGES; stage++)
+  {
+    if (g_latency_alarm_ms > 0 && getLatencyPercentile(&g_latency[stage], 99) > g_latency_alarm_ms * 1000) { ok = false; }
+  }
+  latency["ok"] = ok;
+
+  return ok;
+}
+
+void getNetworkJson(JsonVariant json)
+{
+  JsonObject network = json.createNestedObject("network");
+  
+  byte mac[6]; 
+
+  #if defined(ETHMODE)
+  network["mode"] = "ethernet";
+  network["ip"] = ETH.localIP();
+  network["mac"] = ETH.macAddress();
+
+  #elif defined(WIFIMODE)
+  network["mode"] = "wifi";
+  WiFi.macAddress(mac);
+  network["ip"] = WiFi.localIP();
+  #endif
+  
+  char mac_display[18];
+  sprintf_P(mac_display, PSTR("%02X:%02X:%02X:%02X:%02X:%02X"), mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
+  network["mac"] = mac_display;
+}
+
+void createOutputTypeEnum(JsonObject parent)
+{
+  JsonArray typeEnum = parent.createNestedArray("enum");
+
+  typeEnum.add("relay");
+  typeEnum.add("motor");
+  typeEnum.add("timer");  
+  typeEnum.add("pulse");
 }
 
 void createInputTypeEnum(JsonObject parent)
 {
-  JsonArray typeEnum = parent.createNestedArray("enum");
-  
-  typeEnum.add("button");
-  typeEnum.add("contact");
-  typeEnum.add("press");
-  typeEnum.add("rotary");
-  typeEnum.add("security");
-  typeEnum.add("switch");
-  typeEnum.add("toggle");
+  JsonArray typeEnum = parent.createNestedArray("enum");
+  
+  typeEnum.add("button");
+  typeEnum.add("contact");
+  typeEnum.add("press");
+  typeEnum.add("rotary");
+  typeEnum.add("security");
+  typeEnum.add("switch");
+  typeEnum.add("toggle");
+}
+
+void getConfigSchemaJson(JsonVariant json)
+{
+  JsonObject configSchema = json.createNestedObject("configSchema");
+  
+  // Config schema metadata
+  configSchema["$schema"] = JSON_SCHEMA_VERSION;
+  configSchema["title"] = FW_SHORT_NAME;
+  configSchema["type"] = "object";
+
+  // OUTPUTS
+  JsonObject properties = configSchema.createNestedObject("properties");
+
+  JsonObject outputsPerMcp = properties.createNestedObject("outputsPerMcp");
+  outputsPerMcp["title"] = "Number Of Outputs Per MCP";
+  outputsPerMcp["description"] = "Number of outputs connected to each MCP23017 I/O chip, which is dependent on the relay driver used (must be either 8 or 16, defaults to 16).";
+  outputsPerMcp["type"] = "integer";
+  outputsPerMcp["minimum"] = 8;
+  outputsPerMcp["maximum"] = PCF_PIN_COUNT;
+  outputsPerMcp["multipleOf"] = 8;
+
+  JsonObject defaultOutputType = properties.createNestedObject("defaultOutputType");
+  defaultOutputType["title"] = "Default Output Type";
+  defaultOutputType["description"] = "Set the default output type for anything without explicit configuration below. Defaults to ‘relay’.";
+  createOutputTypeEnum(defaultOutputType);
+
+  JsonObject outputs1 = properties.createNestedObject("outputs");
+  outputs1["title"] = "Output Configuration";
+  outputs1["description"] = "Add configuration for each output in use on your device. The 1-based index specifies which output you wish to configure. The type defines how an output is controlled. For ‘timer’ outputs you can define how long it should stay ON (defaults to 60 seconds). For ‘pulse’ outputs you can define the pulse length in milliseconds (defaults to 250ms). Interlocking two outputs ensures they are never both on at the same time (useful for controlling motors). Restoring a ‘relay’ output sets it back to its last state when the device boots, instead of off.";
+  outputs1["type"] = "array";
+  
+  JsonObject items1 = outputs1.createNestedObject("items");
+  items1["type"] = "object";
+
+  JsonObject properties1 = items1.createNestedObject("properties");
+
+  JsonObject index1 = properties1.createNestedObject("index");
+  index1["title"] = "Index";
+  index1["type"] = "integer";
+  index1["minimum"] = 1;
+  index1["maximum"] = getMaxIndex();
+
+  JsonObject type1 = properties1.createNestedObject("type");
+  type1["title"] = "Type";
+  createOutputTypeEnum(type1);
+
+  JsonObject timerSeconds1 = properties1.createNestedObject("timerSeconds");
+  timerSeconds1["title"] = "Timer (seconds)";
+  timerSeconds1["type"] = "integer";
+  timerSeconds1["minimum"] = 1;
+
+  JsonObject pulseMs1 = properties1.createNestedObject("pulseMs");
+  pulseMs1["title"] = "Pulse (ms)";
+  pulseMs1["type"] = "integer";
+  pulseMs1["minimum"] = MIN_PULSE_MS;
+  pulseMs1["maximum"] = MAX_PULSE_MS;
+
+  JsonObject restore1 = properties1.createNestedObject("restore");
+  restore1["title"] = "Restore On Boot";
+  restore1["type"] = "boolean";
+
+  JsonObject interlockIndex1 = properties1.createNestedObject("interlockIndex");
+  interlockIndex1["title"] = "Interlock With Index";
+  interlockIndex1["description"] = "Interlock with another output on the same board. Use 'Interlock Groups' to interlock outputs on different boards, or more than two outputs. Not available for pulse outputs.";
+  interlockIndex1["type"] = "integer";
+  interlockIndex1["minimum"] = 1;
+  interlockIndex1["maximum"] = getMaxIndex();
+
+  JsonArray required1 = items1.createNestedArray("required");
+  required1.add("index");
+
+  // INPUTS
+  JsonObject defaultInputType2 = properties.createNestedObject("defaultInputType");
+  defaultInputType2["title"] = "Default Input Type";
+  defaultInputType2["description"] = "Set the default input type for anything without explicit configuration below. Defaults to ‘switch’.";
+  createInputTypeEnum(defaultInputType2);
+
+  JsonObject inputDebounceMs2 = properties.createNestedObject("inputDebounceMs");
+  inputDebounceMs2["title"] = "Input Debounce (ms)";
+  inputDebounceMs2["description"] = "How long the inputs on each board must be stable before they are passed on, one entry per input board in order (0 to disable, the default). Filters all 16 inputs of a board at once, ahead of the per input handling.";
+  inputDebounceMs2["type"] = "array";
+  inputDebounceMs2["maxItems"] = PCF_COUNT;
+
+  JsonObject inputDebounceItems2 = inputDebounceMs2.createNestedObject("items");
+  inputDebounceItems2["type"] = "integer";
+  inputDebounceItems2["minimum"] = 0;
+  inputDebounceItems2["maximum"] = MAX_INPUT_DEBOUNCE_MS;
+
+  JsonObject inputs2 = properties.createNestedObject("inputs");
+  inputs2["title"] = "Input Configuration";
+  inputs2["description"] = "Add configuration for each input in use on your device. The 1-based index specifies which input you wish to configure. The type defines how an input is monitored and what events are emitted. Inverting an input swaps the 'active' state (only useful for 'contact' and 'switch' inputs). Disabling an input stops any events being emitted. The rate limit caps how many events per second an input can emit (0 to disable, defaults to 20) - an input exceeding it raises a 'flood' event and is then summarised once a second, with its last event and how many events were suppressed.";
+  inputs2["type"] = "array";
+  
+  JsonObject items2 = inputs2.createNestedObject("items");
+  items2["type"] = "object";
+
+  JsonObject properties2 = items2.createNestedObject("properties");
+
+  JsonObject index2 = properties2.createNestedObject("index");
+  index2["title"] = "Index";
+  index2["type"] = "integer";
+  index2["minimum"] = 1;
+  index2["maximum"] = getMaxIndex();
+
+  JsonObject type2 = properties2.createNestedObject("type");
+  type2["title"] = "Type";
+  createInputTypeEnum(type2);
+
+  JsonObject invert2 = properties2.createNestedObject("invert");
+  invert2["title"] = "Invert";
+  invert2["type"] = "boolean";
+
+  JsonObject disabled2 = properties2.createNestedObject("disabled");
+  disabled2["title"] = "Disabled";
+  disabled2["type"] = "boolean";
+
+  JsonObject rateLimit2 = properties2.createNestedObject("rateLimit");
+  rateLimit2["title"] = "Rate Limit (events/sec)";
+  rateLimit2["type"] = "integer";
+  rateLimit2["minimum"] = 0;
+  rateLimit2["maximum"] = 255;
+
+  JsonArray required2 = items2.createNestedArray("required");
+  required2.add("index");
+
+  // INTERLOCK GROUPS
+  JsonObject interlockGroups4 = properties.createNestedObject("interlockGroups");
+  interlockGroups4["title"] = "Interlock Groups";
+  interlockGroups4["description"] = "Groups of outputs, on any board, where at most one output can be on. Switching an output on switches the rest of its group off first. Up to 32 groups are supported.";
+  interlockGroups4["type"] = "array";
+  interlockGroups4["maxItems"] = INTERLOCK_MAX_GROUPS;
+
+  JsonObject items4 = interlockGroups4.createNestedObject("items");
+  items4["type"] = "object";
+
+  JsonObject properties4 = items4.createNestedObject("properties");
+
+  JsonObject indexes4 = properties4.createNestedObject("indexes");
+  indexes4["title"] = "Indexes";
+  indexes4["type"] = "array";
+  indexes4["minItems"] = 2;
+
+  JsonObject indexItems4 = indexes4.createNestedObject("items");
+  indexItems4["type"] = "integer";
+  indexItems4["minimum"] = 1;
+  indexItems4["maximum"] = getMaxIndex();
+
+  JsonArray required4 = items4.createNestedArray("required");
+  required4.add("indexes");
+
+  JsonObject interlockDelayMs = properties.createNestedObject("interlockDelayMs");
+  interlockDelayMs["title"] = "Interlock Delay (ms)";
+  interlockDelayMs["description"] = "How long to wait after switching off the rest of an interlock group before switching an output on (defaults to 50ms).";
+  interlockDelayMs["type"] = "integer";
+  interlockDelayMs["minimum"] = 0;
+  interlockDelayMs["maximum"] = 1000;
+
+  // SCENES
+  JsonObject scenes3 = properties.createNestedObject("scenes");
+  scenes3["title"] = "Scenes";
+  scenes3["description"] = "Named presets of output states, stored on the device and recalled with a single 'scene' command. Outputs interlocked with an output the scene turns on are turned off. Up to 16 scenes are supported.";
+  scenes3["type"] = "array";
+  scenes3["maxItems"] = SCENE_MAX_COUNT;
+
+  JsonObject items3 = scenes3.createNestedObject("items");
+  items3["type"] = "object";
+
+  JsonObject properties3 = items3.createNestedObject("properties");
+
+  JsonObject name3 = properties3.createNestedObject("name");
+  name3["title"] = "Name";
+  name3["type"] = "string";
+  name3["maxLength"] = SCENE_NAME_MAX_LEN;
+
+  JsonObject outputs3 = properties3.createNestedObject("outputs");
+  outputs3["title"] = "Outputs";
+  outputs3["type"] = "array";
+
+  JsonObject outputItems3 = outputs3.createNestedObject("items");
+  outputItems3["type"] = "object";
+
+  JsonObject outputProperties3 = outputItems3.createNestedObject("properties");
+
+  JsonObject index3 = outputProperties3.createNestedObject("index");
+  index3["title"] = "Index";
+  index3["type"] = "integer";
+  index3["minimum"] = 1;
+  index3["maximum"] = getMaxIndex();
+
+  JsonObject state3 = outputProperties3.createNestedObject("state");
+  state3["title"] = "State";
+  state3["type"] = "string";
+  JsonArray stateEnum3 = state3.createNestedArray("enum");
+  stateEnum3.add("on");
+  stateEnum3.add("off");
+
+  JsonArray outputRequired3 = outputItems3.createNestedArray("required");
+  outputRequired3.add("index");
+  outputRequired3.add("state");
+
+  JsonArray required3 = items3.createNestedArray("required");
+  required3.add("name");
+  required3.add("outputs");
+
+  // SUPERVISOR
+  JsonObject loopBudgetMs = properties.createNestedObject("loopBudgetMs");
+  loopBudgetMs["title"] = "Loop Budget (ms)";
+  loopBudgetMs["description"] = "Maximum time a single pass of the main loop may take before it is recorded as a stall (defaults to 250ms). Stalls are published as telemetry and available via the REST API at /stalls.";
+  loopBudgetMs["type"] = "integer";
+  loopBudgetMs["minimum"] = 10;
+  loopBudgetMs["maximum"] = TASK_WDT_TIMEOUT_S * 1000;
+
+  // INPUT SAMPLING
+  JsonObject inputSampleHz = properties.createNestedObject("inputSampleHz");
+  inputSampleHz["title"] = "Input Sample Rate (Hz)";
+  inputSampleHz["description"] = "Read the inputs from a hardware timer at this fixed rate, rather than once per pass of the main loop. Samples are queued with their timestamps, so no change is missed and debounce is timed from when each sample was taken, however busy the network is. Set to 0 to disable (defaults to 0). Jitter and missed deadlines are published with the stats, and available via the REST API at /metrics.";
+  inputSampleHz["type"] = "integer";
+  inputSampleHz["minimum"] = 0;
+  inputSampleHz["maximum"] = MAX_INPUT_SAMPLE_HZ;
+
+  // IDLE PACING
+  JsonObject idleSleepMs = properties.createNestedObject("idleSleepMs");
+  idleSleepMs["title"] = "Idle Sleep (ms)";
+  idleSleepMs["description"] = "Longest the main loop sleeps between passes once nothing has happened for a second. Inputs are still sampled, and timers checked, at least this often. MQTT, REST and websocket traffic wakes it within 5ms. Set to 0 to disable (defaults to 0). Duty cycle and wake latency are available via the REST API at /metrics.";
+  idleSleepMs["type"] = "integer";
+  idleSleepMs["minimum"] = 0;
+  idleSleepMs["maximum"] = MAX_IDLE_SLEEP_MS;
+
+  JsonObject idleCpuMhz = properties.createNestedObject("idleCpuMhz");
+  idleCpuMhz["title"] = "Idle CPU Clock (MHz)";
+  idleCpuMhz["description"] = "CPU clock to drop to while the main loop is idle, back to 240MHz as soon as anything happens. Only used when idle sleep is enabled. Set to 0 to disable (defaults to 0).";
+  idleCpuMhz["type"] = "integer";
+  JsonArray idleCpuMhzEnum = idleCpuMhz.createNestedArray("enum");
+  idleCpuMhzEnum.add(0);
+  idleCpuMhzEnum.add(80);
+  idleCpuMhzEnum.add(160);
+
+  // DIRECT COMMANDS
+  JsonObject directCommandTopics = properties.createNestedObject("directCommandTopics");
+  directCommandTopics["title"] = "Direct Command Topics";
+  directCommandTopics["description"] = "Subscribe to a command topic per output, i.e. '<command topic>/output/<index>', which accepts a raw ‘on’, ‘off’, ‘toggle’ or ‘query’ payload rather than json (defaults to false).";
+  directCommandTopics["type"] = "boolean";
+
+  // UDP EVENTS
+  JsonObject udpEventAddress = properties.createNestedObject("udpEventAddress");
+  udpEventAddress["title"] = "UDP Event Address";
+  udpEventAddress["description"] = "Also send every input and output event to this multicast (e.g. 239.0.0.1) or unicast IP address, as a compact binary record with a sequence number. Leave empty to disable (the default).";
+  udpEventAddress["type"] = "string";
+
+  JsonObject udpEventPort = properties.createNestedObject("udpEventPort");
+  udpEventPort["title"] = "UDP Event Port";
+  udpEventPort["description"] = "Port to send UDP events to (defaults to 5147).";
+  udpEventPort["type"] = "integer";
+  udpEventPort["minimum"] = 1;
+  udpEventPort["maximum"] = 65535;
+
+  // LATENCY
+  JsonObject latencyAlarmMs = properties.createNestedObject("latencyAlarmMs");
+  latencyAlarmMs["title"] = "Latency Alarm (ms)";
+  latencyAlarmMs["description"] = "Command to output and input to publish latency above which samples are counted as exceeded, and /latency fails once the 99th percentile is over it. Set to 0 to disable (defaults to 50ms).";
+  latencyAlarmMs["type"] = "integer";
+  latencyAlarmMs["minimum"] = 0;
+
+  // HOME ASSISTANT
+  JsonObject homeAssistantDiscovery = properties.createNestedObject("homeAssistantDiscovery");
+  homeAssistantDiscovery["title"] = "Home Assistant Discovery";
+  homeAssistantDiscovery["description"] = "Publish Home Assistant MQTT discovery configs for every output and input, based on their configured type. Published a couple at a time in the background, and only re-published when a type changes (defaults to false).";
+  homeAssistantDiscovery["type"] = "boolean";
+
+  JsonObject homeAssistantPrefix = properties.createNestedObject("homeAssistantPrefix");
+  homeAssistantPrefix["title"] = "Home Assistant Discovery Prefix";
+  homeAssistantPrefix["description"] = "Topic prefix Home Assistant listens to for discovery configs (defaults to 'homeassistant').";
+  homeAssistantPrefix["type"] = "string";
+  homeAssistantPrefix["maxLength"] = HASS_PREFIX_MAX_LEN;
+
+  // STATS
+  JsonObject statsIntervalSeconds = properties.createNestedObject("statsIntervalSeconds");
+  statsIntervalSeconds["title"] = "Stats Interval (seconds)";
+  statsIntervalSeconds["description"] = "How often to publish per channel event counts and rates (events per minute) as telemetry. Set to 0 to disable (defaults to 60 seconds). Also available via the REST API at /stats.";
+  statsIntervalSeconds["type"] = "integer";
+  statsIntervalSeconds["minimum"] = 0;
+}
+
+void getCommandSchemaJson(JsonVariant json)
+{
+  JsonObject commandSchema = json.createNestedObject("commandSchema");
+  
+  // Command schema metadata
+  commandSchema["$schema"] = JSON_SCHEMA_VERSION;
+  commandSchema["title"] = FW_SHORT_NAME;
+  commandSchema["type"] = "object";
+
+  JsonObject properties = commandSchema.createNestedObject("properties");
+
+  JsonObject outputs1 = properties.createNestedObject("outputs");
+  outputs1["title"] = "Output Commands";
+  outputs1["description"] = "Send commands to one or more outputs on your device. The 1-based index specifies which output you wish to command. The type is used to validate the configuration for this output matches the command. Supported commands are ‘on’, ‘off’ or ‘toggle’ to change the output state, or ‘query’ to publish the current state to MQTT. Sending ‘on’ to a ‘pulse’ output starts (or restarts) a pulse, ‘off’ cancels it.";
+  outputs1["type"] = "array";
+  
+  JsonObject items1 = outputs1.createNestedObject("items");
+  items1["type"] = "object";
+
+  JsonObject properties1 = items1.createNestedObject("properties");
+
+  JsonObject index1 = properties1.createNestedObject("index");
+  index1["title"] = "Index";
+  index1["type"] = "integer";
+  index1["minimum"] = 1;
+  index1["maximum"] = getMaxIndex();
+
+  JsonObject type1 = properties1.createNestedObject("type");
+  type1["title"] = "Type";
+  createOutputTypeEnum(type1);
+
+  JsonObject command1 = properties1.createNestedObject("command");
+  command1["title"] = "Command";
+  command1["type"] = "string";
+  JsonArray commandEnum1 = command1.createNestedArray("enum");
+  commandEnum1.add("query");
+  commandEnum1.add("on");
+  commandEnum1.add("off");
+  commandEnum1.add("toggle");
+
+  JsonArray required1 = items1.createNestedArray("required");
+  required1.add("index");
+  required1.add("command");
+
+  JsonObject scene2 = properties.createNestedObject("scene");
+  scene2["title"] = "Recall Scene";
+  scene2["description"] = "Recall a scene by name, setting all of its outputs in a single write per I/O chip.";
+  scene2["type"] = "string";
+
+  JsonObject capture3 = properties.createNestedObject("capture");
+  capture3["title"] = "Capture";
+  capture3["description"] = "Start or stop capturing raw input words and output commands to flash, for offline analysis. Starting a capture discards any previous one. Download the capture via the REST API at /capture.";
+  capture3["type"] = "string";
+  JsonArray captureEnum3 = capture3.createNestedArray("enum");
+  captureEnum3.add("start");
+  captureEnum3.add("stop");
+
+  JsonObject resetLatency4 = properties.createNestedObject("resetLatency");
+  resetLatency4["title"] = "Reset Latency";
+  resetLatency4["description"] = "Clear the command and input latency histograms, e.g. before a load test. Latency is available via the REST API at /latency and /metrics.";
+  resetLatency4["type"] = "boolean";
+}
+
+void apiAdopt(JsonVariant json)
+{
+  // Build device adoption info
+  getFirmwareJson(json);
+  getSystemJson(json);
+  getNetworkJson(json);
+  getConfigSchemaJson(json);
+  getCommandSchemaJson(json);
+}
+
+/*--------------------------- API -----------------*/
+void apiConnection(Request &req, Response &res)
+{
+  StaticJsonDocument<256> json;
+  getConnectionJson(json.as<JsonVariant>());
+
+  res.set("Content-Type", "application/json");
+  serializeJson(json, res);
+}
+
+void apiStats(Request &req, Response &res)
+{
+  res.set("Content-Type", "application/json");
+  sampleStats_t sampling;
+  getSampleStats(&sampling);
+  writeStatsJson(res, millis(), sampling);
+}
+
+void apiMetrics(Request &req, Response &res)
+{
+  res.set("Content-Type", "text/plain; version=0.0.4");
+  writeMetrics(res);
+}
+
+void apiLatency(Request &req, Response &res)
+{
+  StaticJsonDocument<512> json;
+  bool ok = getLatencyJson(json.as<JsonVariant>());
+
+  // Fail the request if latency has regressed, so scripts can just check the status
+  res.status(ok ? 200 : 503);
+  res.set("Content-Type", "application/json");
+  serializeJson(json, res);
+}
+
+void apiCapture(Request &req, Response &res)
+{
+  // Make sure everything captured so far is on flash
+  if (g_capture_active) { flushCapture(); }
+
+  File file = LittleFS.open(CAPTURE_FILE, "r");
+  if (!file)
+  {
+    res.sendStatus(404);
+    return;
+  }
+
+  captureHeader_t header;
+  if (file.read((uint8_t *)&header, sizeof(header)) != sizeof(header) || header.magic != CAPTURE_MAGIC)
+  {
+    file.close();
+    res.sendStatus(404);
+    return;
+  }
+
+  res.set("Content-Type", "application/octet-stream");
+
+  // Stream the records oldest first, i.e. unwrap the ring
+  uint32_t start = header.wrapped ? header.head : 0;
+  uint32_t length = header.wrapped ? CAPTURE_RING_SIZE : header.head;
+
+  uint8_t buffer[256];
+  uint32_t sent = 0;
+  while (sent < length)
+  {
+    uint32_t offset = (start + sent) % CAPTURE_RING_SIZE;
+    uint32_t chunk = min((uint32_t)sizeof(buffer), min(length - sent, CAPTURE_RING_SIZE - offset));
+
+    file.seek(sizeof(captureHeader_t) + offset);
+    size_t read = file.read(buffer, chunk);
+    if (read == 0) { break; }
+
+    res.write(buffer, read);
+    sent += read;
+  }
+
+  file.close();
+}
+
+void apiStalls(Request &req, Response &res)
+{
+  DynamicJsonDocument json(1024);
+  getStallsJson(json.as<JsonVariant>(), false);
+
+  res.set("Content-Type", "application/json");
+  serializeJson(json, res);
+}
+
+/*--------------------------- Home Assistant discovery -----------------*/
+uint8_t getHassOutputEntity(uint8_t index)
+{
+  uint8_t pcf = (index - 1) / g_pcf_output_pins;
+  uint8_t pin = (index - 1) % g_pcf_output_pins;
+
+  if (!g_hass_discovery || index > getMaxOutputIndex() || bitRead(g_pcfs_found_do, pcf) == 0) { return 0; }
+  return oxrsOutput[pcf].getType(pin) + 1;
+}
+
+uint8_t getHassInputEntity(uint8_t index)
+{
+  uint8_t pcf = (index - 1) / PCF_PIN_COUNT;
+  uint8_t pin = (index - 1) % PCF_PIN_COUNT;
+
+  if (!g_hass_discovery || bitRead(g_pcfs_found_di, pcf) == 0 || g_input_config[pcf][pin].disabled) { return 0; }
+  return oxrsInput[pcf].getType(pin) + 1;
+}
+
+const char * getHassComponent(bool output, uint8_t type)
+{
+  if (output) { return type == PULSE ? "button" : "switch"; }
+
+  switch (type)
+  {
+    case CONTACT:
+    case SECURITY:
+    case SWITCH:
+      return "binary_sensor";
+    default:
+      return "event";
+  }
+}
+
+void getHassTopic(char topic[], bool output, uint8_t index, uint8_t type)
+{
+  sprintf_P(topic, PSTR("%s/%s/%s/%s_%u/config"), g_hass_prefix, getHassComponent(output, type), mqtt.getClientId(), output ? "output" : "input", index);
+}
+
+void getHassEntityJson(JsonVariant json, bool output, uint8_t index, uint8_t type)
+{
+  char name[16];
+  sprintf_P(name, PSTR("%s %u"), output ? "Output" : "Input", index);
+  json["name"] = name;
+
+  char uniqueId[48];
+  sprintf_P(uniqueId, PSTR("%s_%s_%u"), mqtt.getClientId(), output ? "output" : "input", index);
+  json["unique_id"] = uniqueId;
+
+  json["availability_topic"] = g_mqtt_lwt_topic;
+  json["availability_template"] = "{{ 'online' if value_json.online else 'offline' }}";
+
+  JsonObject device = json.createNestedObject("device");
+  JsonArray identifiers = device.createNestedArray("identifiers");
+  identifiers.add(mqtt.getClientId());
+  char deviceName[48];
+  sprintf_P(deviceName, PSTR("%s %s"), FW_SHORT_NAME, mqtt.getClientId());
+  device["name"] = deviceName;
+  device["manufacturer"] = FW_MAKER;
+  device["model"] = BOARD_MODEL;
+  device["sw_version"] = STRINGIFY(FW_VERSION);
+
+  // Inputs and outputs share the status topic, only input events have a port
+  char valueTemplate[160];
+  char payload[64];
+
+  if (output)
+  {
+    // Same shape as any other command batch, jsonCommand() only takes
+    // output commands from the outputs array
+    json["command_topic"] = g_mqtt_command_topic;
+
+    if (type == PULSE)
+    {
+      sprintf_P(payload, PSTR("{\"outputs\":[{\"index\":%u,\"command\":\"on\"}]}"), index);
+      json["payload_press"] = payload;
+      return;
+    }
+
+    json["state_topic"] = g_mqtt_status_topic;
+    sprintf_P(valueTemplate, PSTR("{%% if value_json.index == %u and value_json.port is not defined %%}{{ value_json.event }}{%% endif %%}"), index);
+    json["value_template"] = valueTemplate;
+    json["state_on"] = "on";
+    json["state_off"] = "off";
+
+    sprintf_P(payload, PSTR("{\"outputs\":[{\"index\":%u,\"command\":\"on\"}]}"), index);
+    json["payload_on"] = payload;
+    char payloadOff[64];
+    sprintf_P(payloadOff, PSTR("{\"outputs\":[{\"index\":%u,\"command\":\"off\"}]}"), index);
+    json["payload_off"] = payloadOff;
+    return;
+  }
+
+  json["state_topic"] = g_mqtt_status_topic;
+
+  if (strcmp(getHassComponent(output, type), "binary_sensor") == 0)
+  {
+    sprintf_P(valueTemplate, PSTR("{%% if value_json.index == %u and value_json.port is defined %%}{{ value_json.event }}{%% endif %%}"), index);
+    json["value_template"] = valueTemplate;
+
+    switch (type)
+    {
+      case CONTACT:
+        json["device_class"] = "opening";
+        json["payload_on"] = "open";
+        json["payload_off"] = "closed";
+        break;
+      case SECURITY:
+        json["device_class"] = "safety";
+        json["payload_on"] = "alarm";
+        json["payload_off"] = "normal";
+        break;
+      default:
+        json["payload_on"] = "on";
+        json["payload_off"] = "off";
+        break;
+    }
+    return;
+  }
+
+  sprintf_P(valueTemplate, PSTR("{%% if value_json.index == %u and value_json.port is defined %%}{\"event_type\":\"{{ value_json.event }}\"}{%% endif %%}"), index);
+  json["value_template"] = valueTemplate;
+
+  JsonArray eventTypes = json.createNestedArray("event_types");
+  switch (type)
+  {
+    case BUTTON:
+      json["device_class"] = "button";
+      eventTypes.add("single");
+      eventTypes.add("double");
+      eventTypes.add("triple");
+      eventTypes.add("quad");
+      eventTypes.add("penta");
+      eventTypes.add("hold");
+      break;
+    case PRESS:
+      eventTypes.add("press");
+      break;
+    case ROTARY:
+      eventTypes.add("up");
+      eventTypes.add("down");
+      break;
+    case TOGGLE:
+      eventTypes.add("toggle");
+      break;
+  }
+}
+
+bool publishHassEntity(bool output, uint8_t index, uint8_t published, uint8_t wanted)
+{
+  char topic[96];
+
+  // Remove the old entity if it is going away, or changing component
+  if (published != 0 && (wanted == 0 || strcmp(getHassComponent(output, published - 1), getHassComponent(output, wanted - 1)) != 0))
+  {
+    getHassTopic(topic, output, index, published - 1);
+    boolean success = mqttClient.publish(topic, "", true);
+    countPublish(success);
+    if (!success) { return false; }
+  }
+
+  if (wanted == 0) { return true; }
+
+  DynamicJsonDocument json(1024);
+  getHassEntityJson(json.as<JsonVariant>(), output, index, wanted - 1);
+
+  getHassTopic(topic, output, index, wanted - 1);
+  return publishJson(topic, json.as<JsonVariant>(), true);
+}
+
+void processHassDiscovery()
+{
+  if (!g_hass_pending || !mqttClient.connected()) { return; }
+
+  // Walk every output then every input, publishing at most a couple of
+  // entities per pass so a full discovery never holds up the loop
+  uint8_t published = 0;
+  while (published < HASS_ENTITIES_PER_PASS)
+  {
+    uint16_t entity = g_hass_cursor;
+    g_hass_cursor = (g_hass_cursor + 1) % (CHANNEL_COUNT * 2);
+
+    bool output = entity < CHANNEL_COUNT;
+    uint8_t index = (entity % CHANNEL_COUNT) + 1;
+    uint8_t * last = output ? &g_hass_outputs[index - 1] : &g_hass_inputs[index - 1];
+    uint8_t wanted = output ? getHassOutputEntity(index) : getHassInputEntity(index);
+
+    if (wanted == *last)
+    {
+      if (++g_hass_clean >= CHANNEL_COUNT * 2)
+      {
+        g_hass_pending = false;
+        return;
+      }
+      continue;
+    }
+
+    // Anything which fails is retried on the next lap
+    if (publishHassEntity(output, index, *last, wanted)) { *last = wanted; }
+    g_hass_clean = 0;
+    published++;
+  }
+}
+
+void resetHassDiscovery()
+{
+  g_hass_clean = 0;
+  g_hass_pending = true;
+}
+
+/*--------------------------- MQTT/API -----------------*/
+void publishStalls()
+{
+  if (!g_stall_unpublished) { return; }
+  
+  DynamicJsonDocument json(1024);
+  getStallsJson(json.as<JsonVariant>(), true);
+
+  // Leave the records flagged as unpublished if this fails so we retry
+  if (publishTelemetry(json))
+  {
+    portENTER_CRITICAL(&g_stall_mux);
+    for (uint8_t i = 0; i < g_stall_count; i++)
+    {
+      g_stalls[i].published = true;
+    }
+    g_stall_unpublished = false;
+    portEXIT_CRITICAL(&g_stall_mux);
+  }
+}
+
+void publishStats()
+{
+  if (!isNetworkConnected() || !mqttClient.connected()) { return; }
+
+  // Channel stats are only updated from the loop, and the sampling stats
+  // are copied once, so nothing can change between measuring the payload
+  // and streaming it
+  uint32_t now = millis();
+  sampleStats_t sampling;
+  getSampleStats(&sampling);
+
+  CountingPrint counter;
+  writeStatsJson(counter, now, sampling);
+
+  if (!mqttClient.beginPublish(g_mqtt_telemetry_topic, counter.count(), false)) 
+  { 
+    countPublish(false);
+    return; 
+  }
+
+  MqttStream stream(mqttClient);
+  writeStatsJson(stream, now, sampling);
+  stream.flush();
+
+  countPublish(mqttClient.endPublish() && stream.written() == counter.count());
+}
+
+void publishConnection()
+{
+  StaticJsonDocument<128> json;
+  JsonObject connection = json.createNestedObject("connection");
+  connection["attempts"] = g_mqtt_outage_attempts;
+  connection["connectingMs"] = g_mqtt_outage_connecting_ms;
+
+  publishTelemetry(json);
+}
+
+void loopMqtt()
+{
+  // Let PubSubClient service the connection while we are connected
+  if (mqttClient.connected())
+  {
+    mqtt.loop();
+    return;
+  }
+
+  // No point trying to reach the broker without a link and IP address,
+  // and anything in progress went with the link
+  if (!isNetworkConnected()) 
+  { 
+    client.abort();
+    return; 
+  }
+
+  uint32_t attempts = client.attempts();
+
+  if (client.connecting())
+  {
+    // Poll the lookup and TCP handshake ourselves, every pass, rather than
+    // leaving it to OXRS_MQTT which only retries after its own backoff
+    if (!client.poll() && client.connecting()) { return; }
+
+    // Accepted, so have OXRS_MQTT connect now - clearing its backoff - and
+    // do the MQTT handshake over the socket, bounded by the socket timeout
+    if (client.connecting())
+    {
+      mqtt.reconnect();
+      mqtt.loop();
+    }
+  }
+  else
+  {
+    // Wait out any backoff from previous failed attempts
+    if ((int32_t)(millis() - g_mqtt_next_attempt_ms) < 0) { return; }
+
+    // Starts the lookup and TCP connect, which OXRS_MQTT sees fail (and
+    // backs off from) until we hand the socket over above
+    mqtt.reconnect();
+    mqtt.loop();
+
+    // Nothing started, OXRS_MQTT is still backing off so try next pass
+    if (client.attempts() == attempts && !mqttClient.connected()) { return; }
+  }
+
+  uint32_t started = client.attempts() - attempts;
+  g_mqtt_outage_attempts += started;
+  g_mqtt_total_attempts += started;
+
+  // Still waiting on the broker
+  if (client.connecting()) { return; }
+
+  uint32_t connectingMs;
+  if (client.takeConnectingMs(&connectingMs))
+  {
+    g_mqtt_outage_connecting_ms += connectingMs;
+    g_mqtt_total_connecting_ms += connectingMs;
+  }
+
+  if (mqttClient.connected())
+  {
+    g_mqtt_connects++;
+    g_mqtt_backoff_ms = 0;
+
+    // Report how long this outage took to recover from
+    publishConnection();
+    g_mqtt_outage_attempts = 0;
+    g_mqtt_outage_connecting_ms = 0;
+  }
+  else
+  {
+    // Exponential backoff with jitter so a fleet of devices doesn't
+    // hammer the broker in lock-step when it comes back
+    g_mqtt_backoff_ms = g_mqtt_backoff_ms == 0 ? MQTT_BACKOFF_MIN_MS : min(g_mqtt_backoff_ms * 2, (uint32_t)MQTT_BACKOFF_MAX_MS);
+    g_mqtt_next_attempt_ms = millis() + (g_mqtt_backoff_ms / 2) + random(g_mqtt_backoff_ms / 2);
+  }
+}
+
+void subscribeDirectCommands(bool subscribe)
+{
+  char topic[80];
+  sprintf_P(topic, PSTR("%s+"), g_mqtt_direct_topic);
+
+  if (subscribe)
+  {
+    mqttClient.subscribe(topic);
+  }
+  else
+  {
+    mqttClient.unsubscribe(topic);
+  }
+}
+
+void mqttConnected() 
+{
+  // MqttLogger doesn't copy the logging topic to an internal
+  // buffer so we have to use a static array here
+  static char logTopic[64];
+  logger.setTopic(mqtt.getLogTopic(logTopic));
+
+  // Cache the topics we subscribe and publish to
+  mqtt.getConfigTopic(g_mqtt_config_topic);
+  mqtt.getCommandTopic(g_mqtt_command_topic);
+  sprintf_P(g_mqtt_direct_topic, PSTR("%s/output/"), g_mqtt_command_topic);
+  mqtt.getAdoptTopic(g_mqtt_adopt_topic);
+  mqtt.getStatusTopic(g_mqtt_status_topic);
+  mqtt.getTelemetryTopic(g_mqtt_telemetry_topic);
+  mqtt.getLwtTopic(g_mqtt_lwt_topic);
+
+  // Publish device adoption info
+  DynamicJsonDocument json(JSON_ADOPT_MAX_SIZE);
+  publishAdopt(api.getAdopt(json.as<JsonVariant>()));
+
+  // Log the fact we are now connected
+  logger.println("[stio] mqtt connected");
+
+  // Publish any stalls we recorded while we were offline
+  publishStalls();
+
+  // Subscribe to per-output command topics if enabled
+  if (g_direct_commands) { subscribeDirectCommands(true); }
+}
+
+void mqttDisconnected(int state) 
+{
+  // Not a failure, just still waiting for the broker to accept the connection
+  if (client.connecting()) { return; }
+
+  // Log the disconnect reason
+  // See https://github.com/knolleary/pubsubclient/blob/2d228f2f862a95846c65a8518c79f48dfc8f188c/src/PubSubClient.h#L44
+  switch (state)
+  {
+    case MQTT_CONNECTION_TIMEOUT:
+      logger.println(F("[stio] mqtt connection timeout"));
+      break;
+    case MQTT_CONNECTION_LOST:
+      logger.println(F("[stio] mqtt connection lost"));
+      break;
+    case MQTT_CONNECT_FAILED:
+      logger.println(F("[stio] mqtt connect failed"));
+      break;
+    case MQTT_DISCONNECTED:
+      logger.println(F("[stio] mqtt disconnected"));
+      break;
+    case MQTT_CONNECT_BAD_PROTOCOL:
+      logger.println(F("[stio] mqtt bad protocol"));
+      break;
+    case MQTT_CONNECT_BAD_CLIENT_ID:
+      logger.println(F("[stio] mqtt bad client id"));
+      break;
+    case MQTT_CONNECT_UNAVAILABLE:
+      logger.println(F("[stio] mqtt unavailable"));
+      break;
+    case MQTT_CONNECT_BAD_CREDENTIALS:
+      logger.println(F("[stio] mqtt bad credentials"));
+      break;      
+    case MQTT_CONNECT_UNAUTHORIZED:
+      logger.println(F("[stio] mqtt unauthorised"));
+      break;      
+  }
+}
+
+void handleOutputCommand(uint8_t index, uint8_t type, const char * command)
+{
+  // Work out the pcf and pin we are processing
+  uint8_t pcf1 = (index - 1) / g_pcf_output_pins;
+  uint8_t pin1 = (index - 1) % g_pcf_output_pins;
+
+  if (command == NULL || strcmp(command, "query") == 0)
+  {
+    // Publish a status event with the current state
+    uint8_t state = getOutputState(pcf1, pin1);
+    publishEventOutput(index, type, state);
+    return;
+  }
+
+  uint8_t state;
+  if (strcmp(command, "on") == 0)
+  {
+    state = RELAY_ON;
+  }
+  else if (strcmp(command, "off") == 0)
+  {
+    state = RELAY_OFF;
+  }
+  else if (strcmp(command, "toggle") == 0)
+  {
+    state = getOutputState(pcf1, pin1) == RELAY_ON ? RELAY_OFF : RELAY_ON;
+  }
+  else 
+  {
+    logger.println(F("[stio] invalid command"));
+    return;
+  }
+
+  captureOutput(index, state);
+
+  if (type == PULSE)
+  {
+    // Pulses are timed by the pulse timer, not our output handler
+    if (state == RELAY_ON) { startPulse(pcf1, pin1); } else { stopPulse(pcf1, pin1); }
+  }
+  else
+  {
+    // Send this command down to our output handler to process
+    oxrsOutput[pcf1].handleCommand(pcf1, pin1, state);
+  }
+}
+
+void jsonOutputCommand(JsonVariant json)
+{
+  uint8_t index = getIndex(json);
+  if (index == 0) return;
+
+  // Get the output type for this pin
+  uint8_t type = oxrsOutput[(index - 1) / g_pcf_output_pins].getType((index - 1) % g_pcf_output_pins);
+  
+  if (json.containsKey("type"))
+  {
+    if (parseOutputType(json["type"]) != type)
+    {
+      logger.println(F("[stio] command type doesn't match configured type"));
+      return;
+    }
+  }
+  
+  if (json.containsKey("command"))
+  {
+    handleOutputCommand(index, type, json["command"]);
+  }
+}
+
+void directOutputCommand(const char * suffix, uint8_t * payload, unsigned int length)
+{
+  // The topic suffix is the 1-based index, and nothing else
+  uint16_t index = 0;
+  for (const char * c = suffix; *c; c++)
+  {
+    if (*c < '0' || *c > '9' || index > 255)
+    {
+      logger.println(F("[stio] invalid index"));
+      return;
+    }
+    index = (index * 10) + (*c - '0');
+  }
+
+  if (index > 255 || validateIndex(index) == 0) return;
+
+  // The payload is the raw command
+  char command[8];
+  if (length >= sizeof(command))
+  {
+    logger.println(F("[stio] invalid command"));
+    return;
+  }
+  memcpy(command, payload, length);
+  command[length] = 0;
+
+  uint8_t type = oxrsOutput[(index - 1) / g_pcf_output_pins].getType((index - 1) % g_pcf_output_pins);
+  handleOutputCommand(index, type, length == 0 ? NULL : command);
+}
+
+void jsonCommand(JsonVariant json)
+{
+  if (json.containsKey("outputs"))
+  {
+    for (JsonVariant output : json["outputs"].as<JsonArray>())
+    {
+      jsonOutputCommand(output);
+    }
+  }
+
+  if (json.containsKey("scene"))
+  {
+    recallScene(json["scene"]);
+  }
+
+  if (json.containsKey("capture"))
+  {
+    if (strcmp(json["capture"], "start") == 0)
+    {
+      startCapture();
+    }
+    else if (strcmp(json["capture"], "stop") == 0)
+    {
+      stopCapture();
+    }
+    else
+    {
+      logger.println(F("[stio] invalid capture command"));
+    }
+  }
+
+  if (json.containsKey("resetLatency") && json["resetLatency"].as<bool>())
+  {
+    resetLatency();
+  }
+}
+
+void jsonOutputConfig(JsonVariant json)
+{
+  uint8_t index = getIndex(json);
+  if (index == 0) return;
+
+  // Work out the MCP and pin we are configuring
+  uint8_t pcf1 = (index - 1) / g_pcf_output_pins;
+  uint8_t pin1 = (index - 1) % g_pcf_output_pins;
+
+  if (json.containsKey("type"))
+  {
+    uint8_t outputType = parseOutputType(json["type"]);    
+
+    if (outputType != INVALID_OUTPUT_TYPE)
+    {
+      g_output_config_staging[pcf1][pin1].type = outputType;
+    }
+  }
+  
+  if (json.containsKey("timerSeconds"))
+  {
+    if (json["timerSeconds"].isNull())
+    {
+      g_output_config_staging[pcf1][pin1].timerSeconds = DEFAULT_TIMER_SECS;
+    }
+    else
+    {
+      g_output_config_staging[pcf1][pin1].timerSeconds = json["timerSeconds"].as<uint16_t>();
+    }
+  }
+  
+  if (json.containsKey("pulseMs"))
+  {
+    if (json["pulseMs"].isNull())
+    {
+      g_pulse_ms[pcf1][pin1] = DEFAULT_PULSE_MS;
+    }
+    else
+    {
+      // Read wide so out of range values clamp rather than wrap
+      g_pulse_ms[pcf1][pin1] = constrain(json["pulseMs"].as<uint32_t>(), (uint32_t)MIN_PULSE_MS, (uint32_t)MAX_PULSE_MS);
+    }
+  }
+
+  if (json.containsKey("restore"))
+  {
+    bitWrite(g_pcf_restore_pins[pcf1], pin1, json["restore"].as<bool>());
+  }
+
+  if (json.containsKey("interlockIndex"))
+  {
+    // If an empty message then treat as 'unlocked' - i.e. interlock with ourselves
+    if (json["interlockIndex"].isNull())
+    {
+      g_output_config_staging[pcf1][pin1].interlock = pin1;
+    }
+    else
+    {
+      uint8_t interlock_index = json["interlockIndex"].as<uint8_t>();
+     
+      uint8_t interlock_pcf1 = (interlock_index - 1) / g_pcf_output_pins;
+      uint8_t interlock_pin1 = (interlock_index - 1) % g_pcf_output_pins;
+  
+      if (interlock_pcf1 == pcf1)
+      {
+        g_output_config_staging[pcf1][pin1].interlock = interlock_pin1;
+      }
+      else
+      {
+        logger.println(F("[stio] lock must be with pin on same mcp, use interlockGroups"));
+      }
+    }
+  }
+}
+
+void beginInterlockGroupsConfig()
+{
+  g_interlock_groups_staged = 0;
 }
 
-void getConfigSchemaJson(JsonVariant json)
+void jsonInterlockGroupConfig(JsonVariant json)
 {
-  JsonObject configSchema = json.createNestedObject("configSchema");
+  if (g_interlock_groups_staged == INTERLOCK_MAX_GROUPS)
+  {
+    logger.println(F("[stio] too many interlock groups"));
+    return;
+  }
+
+  interlockGroup_t * group = &g_interlock_groups_staging[g_interlock_groups_staged];
+  memset(group, 0, sizeof(interlockGroup_t));
+
+  uint8_t members = 0;
+  for (JsonVariant member : json["indexes"].as<JsonArray>())
+  {
+    uint8_t index = validateIndex(member.as<uint8_t>());
+    if (index == 0) continue;
+
+    uint8_t pcf1 = (index - 1) / g_pcf_output_pins;
+    uint8_t pin1 = (index - 1) % g_pcf_output_pins;
+
+    // Each output can only be in one group
+    bool grouped = false;
+    for (uint8_t i = 0; i <= g_interlock_groups_staged; i++)
+    {
+      if (bitRead(g_interlock_groups_staging[i].mask[pcf1], pin1)) { grouped = true; }
+    }
+
+    if (grouped)
+    {
+      logger.println(F("[stio] output already in an interlock group"));
+      continue;
+    }
+
+    bitSet(group->mask[pcf1], pin1);
+    members++;
+  }
+
+  if (members < 2)
+  {
+    logger.println(F("[stio] interlock group needs at least 2 outputs"));
+    return;
+  }
+
+  g_interlock_groups_staged++;
+}
+
+void endInterlockGroupsConfig()
+{
+  applyInterlockGroups(g_interlock_groups_staging, g_interlock_groups_staged);
+}
+
+void jsonInterlockGroupsConfig(JsonVariant json)
+{
+  beginInterlockGroupsConfig();
+  for (JsonVariant group : json.as<JsonArray>())
+  {
+    jsonInterlockGroupConfig(group);
+  }
+  endInterlockGroupsConfig();
+}
+
+void beginScenesConfig()
+{
+  g_scenes_staged = 0;
+}
+
+void jsonSceneConfig(JsonVariant json)
+{
+  if (g_scenes_staged == SCENE_MAX_COUNT)
+  {
+    logger.println(F("[stio] too many scenes"));
+    return;
+  }
+
+  if (compileScene(json, &g_scenes_staging[g_scenes_staged])) { g_scenes_staged++; }
+}
+
+void endScenesConfig()
+{
+  // Config is retained so only write to flash if something has changed
+  if (g_scenes_staged == g_scene_count && memcmp(g_scenes_staging, g_scenes, g_scene_count * sizeof(scene_t)) == 0)
+    return;
+
+  memcpy(g_scenes, g_scenes_staging, g_scenes_staged * sizeof(scene_t));
+  g_scene_count = g_scenes_staged;
+  saveScenes();
+}
+
+void jsonScenesConfig(JsonVariant json)
+{
+  beginScenesConfig();
+  for (JsonVariant scene : json.as<JsonArray>())
+  {
+    jsonSceneConfig(scene);
+  }
+  endScenesConfig();
+}
+
+void jsonInputConfig(JsonVariant json)
+{
+  uint8_t index = getIndex(json);
+  if (index == 0) return;
+
+  // Work out the PCF and pin we are configuring
+  int pcf2 = (index - 1) / PCF_PIN_COUNT;
+  int pin2 = (index - 1) % PCF_PIN_COUNT;
+
+  if (json.containsKey("type"))
+  {
+    uint8_t inputType = parseInputType(json["type"]);    
+
+    if (inputType != INVALID_INPUT_TYPE)
+    {
+      g_input_config_staging[pcf2][pin2].type = inputType;
+    }
+  }
   
-  // Config schema metadata
-  configSchema["$schema"] = JSON_SCHEMA_VERSION;
-  configSchema["title"] = FW_SHORT_NAME;
-  configSchema["type"] = "object";
+  if (json.containsKey("invert"))
+  {
+    g_input_config_staging[pcf2][pin2].invert = json["invert"].as<bool>();
+  }
+
+  if (json.containsKey("disabled"))
+  {
+    g_input_config_staging[pcf2][pin2].disabled = json["disabled"].as<bool>();
+  }
+
+  if (json.containsKey("rateLimit"))
+  {
+    g_input_config_staging[pcf2][pin2].rateLimit = json["rateLimit"].isNull() ? DEFAULT_INPUT_RATE_LIMIT : json["rateLimit"].as<uint8_t>();
+  }
+}
+
+void beginConfig()
+{
+  // Start from what is applied, so anything not in this config is left alone
+  memcpy(g_output_config_staging, g_output_config, sizeof(g_output_config));
+  memcpy(g_input_config_staging, g_input_config, sizeof(g_input_config));
+  g_config_staging = true;
+}
+
+void commitConfig()
+{
+  uint16_t changed = 0;
+
+  // Pulses are switched directly, not through the output handler, so it
+  // can't honour an interlock with one - only interlock groups can
+  bool pulseLocks = false;
+  for (uint8_t pcf1 = 0; pcf1 < PCF_COUNT; pcf1++)
+  {
+    for (uint8_t pin1 = 0; pin1 < PCF_PIN_COUNT; pin1++)
+    {
+      outputConfig_t * staged = &g_output_config_staging[pcf1][pin1];
+      if (staged->interlock == pin1)
+        continue;
+
+      if (staged->type == PULSE || g_output_config_staging[pcf1][staged->interlock].type == PULSE)
+      {
+        staged->interlock = pin1;
+        pulseLocks = true;
+      }
+    }
+  }
+
+  if (pulseLocks)
+  {
+    logger.println(F("[stio] pulse outputs can't use interlockIndex, use interlockGroups"));
+  }
+
+  // Only pass settings down to the handlers if they have changed, since 
+  // they reset the state of anything they touch
+  for (uint8_t pcf1 = 0; pcf1 < PCF_COUNT; pcf1++)
+  {
+    if (bitRead(g_pcfs_found_do, pcf1) == 0)
+      continue;
+
+    for (uint8_t pin1 = 0; pin1 < PCF_PIN_COUNT; pin1++)
+    {
+      outputConfig_t * staged = &g_output_config_staging[pcf1][pin1];
+      outputConfig_t * applied = &g_output_config[pcf1][pin1];
+      bool dirty = false;
+
+      if (staged->type != applied->type)
+      {
+        setOutputType(pcf1, pin1, staged->type);
+        dirty = true;
+      }
+
+      if (staged->timerSeconds != applied->timerSeconds)
+      {
+        oxrsOutput[pcf1].setTimer(pin1, staged->timerSeconds);
+        dirty = true;
+      }
+
+      if (staged->interlock != applied->interlock)
+      {
+        oxrsOutput[pcf1].setInterlock(pin1, staged->interlock);
+        dirty = true;
+      }
+
+      if (dirty)
+      {
+        *applied = *staged;
+        changed++;
+      }
+    }
+  }
+
+  for (uint8_t pcf2 = 0; pcf2 < PCF_COUNT; pcf2++)
+  {
+    if (bitRead(g_pcfs_found_di, pcf2) == 0)
+      continue;
+
+    for (uint8_t pin2 = 0; pin2 < PCF_PIN_COUNT; pin2++)
+    {
+      inputConfig_t * staged = &g_input_config_staging[pcf2][pin2];
+      inputConfig_t * applied = &g_input_config[pcf2][pin2];
+      bool dirty = false;
+
+      if (staged->type != applied->type)
+      {
+        oxrsInput[pcf2].setType(pin2, staged->type);
+        dirty = true;
+      }
+
+      if (staged->invert != applied->invert)
+      {
+        oxrsInput[pcf2].setInvert(pin2, staged->invert);
+        dirty = true;
+      }
+
+      if (staged->disabled != applied->disabled)
+      {
+        oxrsInput[pcf2].setDisabled(pin2, staged->disabled);
+        dirty = true;
+      }
+
+      if (staged->rateLimit != applied->rateLimit)
+      {
+        resetInputLimiter((PCF_PIN_COUNT * pcf2) + pin2 + 1, staged->rateLimit);
+        dirty = true;
+      }
+
+      if (dirty)
+      {
+        *applied = *staged;
+        changed++;
+      }
+    }
+  }
+
+  g_config_staging = false;
+
+  if (changed > 0)
+  {
+    resetHassDiscovery();
+
+    logger.print(F("[stio] config changed for "));
+    logger.print(changed);
+    logger.println(F(" channels"));
+  }
+}
+
+void jsonConfig(JsonVariant json)
+{
+  // Stage everything unless our caller is already staging (i.e. when streaming)
+  bool commit = !g_config_staging;
+  if (commit) { beginConfig(); }
+
+  // SUPERVISOR
+  if (json.containsKey("loopBudgetMs"))
+  {
+    g_loop_budget_ms = json["loopBudgetMs"].isNull() ? DEFAULT_LOOP_BUDGET_MS : json["loopBudgetMs"].as<uint32_t>();
+  }
+
+  // INPUT SAMPLING
+  if (json.containsKey("inputSampleHz"))
+  {
+    uint32_t sampleHz = json["inputSampleHz"].isNull() ? DEFAULT_INPUT_SAMPLE_HZ : json["inputSampleHz"].as<uint32_t>();
+    if (sampleHz != 0 && (sampleHz < MIN_INPUT_SAMPLE_HZ || sampleHz > MAX_INPUT_SAMPLE_HZ))
+    {
+      logger.println(F("[stio] invalid inputSampleHz"));
+    }
+    else
+    {
+      setInputSampleRate(sampleHz);
+    }
+  }
+
+  // IDLE PACING
+  if (json.containsKey("idleSleepMs"))
+  {
+    g_idle_sleep_ms = json["idleSleepMs"].isNull() ? DEFAULT_IDLE_SLEEP_MS : min(json["idleSleepMs"].as<uint32_t>(), (uint32_t)MAX_IDLE_SLEEP_MS);
+  }
+
+  if (json.containsKey("idleCpuMhz"))
+  {
+    uint32_t idleCpuMhz = json["idleCpuMhz"].as<uint32_t>();
+    if (idleCpuMhz != 0 && idleCpuMhz != 80 && idleCpuMhz != 160)
+    {
+      logger.println(F("[stio] invalid idleCpuMhz, must be 0, 80 or 160"));
+    }
+    else
+    {
+      g_idle_cpu_mhz = idleCpuMhz;
+    }
+  }
+
+  // DIRECT COMMANDS
+  if (json.containsKey("directCommandTopics"))
+  {
+    bool directCommands = json["directCommandTopics"].as<bool>();
+    if (directCommands != g_direct_commands && mqttClient.connected())
+    {
+      subscribeDirectCommands(directCommands);
+    }
+    g_direct_commands = directCommands;
+  }
+
+  // UDP EVENTS
+  if (json.containsKey("udpEventAddress"))
+  {
+    const char * address = json["udpEventAddress"];
+    g_udp_events = false;
+
+    if (address != NULL && strlen(address) > 0)
+    {
+      if (g_udp_event_ip.fromString(address))
+      {
+        g_udp_events = true;
+      }
+      else
+      {
+        logger.println(F("[stio] invalid udp event address"));
+      }
+    }
+  }
+
+  if (json.containsKey("udpEventPort"))
+  {
+    g_udp_event_port = json["udpEventPort"].isNull() ? DEFAULT_UDP_EVENT_PORT : json["udpEventPort"].as<uint16_t>();
+  }
+
+  // LATENCY
+  if (json.containsKey("latencyAlarmMs"))
+  {
+    g_latency_alarm_ms = json["latencyAlarmMs"].isNull() ? DEFAULT_LATENCY_ALARM_MS : json["latencyAlarmMs"].as<uint32_t>();
+  }
+
+  // HOME ASSISTANT
+  if (json.containsKey("homeAssistantDiscovery"))
+  {
+    g_hass_discovery = json["homeAssistantDiscovery"].as<bool>();
+    resetHassDiscovery();
+  }
+
+  if (json.containsKey("homeAssistantPrefix"))
+  {
+    // Anything published under the old prefix is left behind
+    strncpy(g_hass_prefix, json["homeAssistantPrefix"].isNull() ? HASS_DEFAULT_PREFIX : json["homeAssistantPrefix"].as<const char *>(), HASS_PREFIX_MAX_LEN);
+    memset(g_hass_outputs, 0, sizeof(g_hass_outputs));
+    memset(g_hass_inputs, 0, sizeof(g_hass_inputs));
+    resetHassDiscovery();
+  }
+
+  // STATS
+  if (json.containsKey("statsIntervalSeconds"))
+  {
+    g_stats_interval_ms = (json["statsIntervalSeconds"].isNull() ? DEFAULT_STATS_INTERVAL_S : json["statsIntervalSeconds"].as<uint32_t>()) * 1000L;
+  }
 
   // OUTPUTS
-  JsonObject properties = configSchema.createNestedObject("properties");
+  if (json.containsKey("outputsPerMcp"))
+  {
+    g_pcf_output_pins = json["outputsPerMcp"].as<uint8_t>();
+    resetHassDiscovery();
+  }
+  
+  if (json.containsKey("defaultOutputType"))
+  {
+    uint8_t outputType = parseOutputType(json["defaultOutputType"]);
 
-  JsonObject outputsPerMcp = properties.createNestedObject("outputsPerMcp");
-  outputsPerMcp["title"] = "Number Of Outputs Per MCP";
-  outputsPerMcp["description"] = "Number of outputs connected to each MCP23017 I/O chip, which is dependent on the relay driver used (must be either 8 or 16, defaults to 16).";
-  outputsPerMcp["type"] = "integer";
-  outputsPerMcp["minimum"] = 8;
-  outputsPerMcp["maximum"] = PCF_PIN_COUNT;
-  outputsPerMcp["multipleOf"] = 8;
+    if (outputType != INVALID_OUTPUT_TYPE)
+    {
+      setDefaultOutputType(outputType);
+    }
+  }
+
+  if (json.containsKey("outputs"))
+  {
+    for (JsonVariant output : json["outputs"].as<JsonArray>())
+    {
+      jsonOutputConfig(output);
+    }
+  }
+
+  if (json.containsKey("interlockDelayMs"))
+  {
+    g_interlock_delay_ms = json["interlockDelayMs"].isNull() ? DEFAULT_INTERLOCK_DELAY_MS : json["interlockDelayMs"].as<uint32_t>();
+  }
+
+  if (json.containsKey("interlockGroups"))
+  {
+    jsonInterlockGroupsConfig(json["interlockGroups"]);
+  }
 
-  JsonObject defaultOutputType = properties.createNestedObject("defaultOutputType");
-  defaultOutputType["title"] = "Default Output Type";
-  defaultOutputType["description"] = "Set the default output type for anything without explicit configuration below. Defaults to ‘relay’.";
-  createOutputTypeEnum(defaultOutputType);
+  // SCENES - after outputs so any interlocks are known
+  if (json.containsKey("scenes"))
+  {
+    jsonScenesConfig(json["scenes"]);
+  }
 
-  JsonObject outputs1 = properties.createNestedObject("outputs");
-  outputs1["title"] = "Output Configuration";
-  outputs1["description"] = "Add configuration for each output in use on your device. The 1-based index specifies which output you wish to configure. The type defines how an output is controlled. For ‘timer’ outputs you can define how long it should stay ON (defaults to 60 seconds). Interlocking two outputs ensures they are never both on at the same time (useful for controlling motors).";
-  outputs1["type"] = "array";
-  
-  JsonObject items1 = outputs1.createNestedObject("items");
-  items1["type"] = "object";
+  // INPUTS
+  if (json.containsKey("inputDebounceMs"))
+  {
+    // One entry per input board, in board order, anything missing uses the default
+    JsonArray debounceMs = json["inputDebounceMs"].as<JsonArray>();
+    for (uint8_t pcf2 = 0; pcf2 < PCF_COUNT; pcf2++)
+    {
+      setInputDebounce(pcf2, pcf2 < debounceMs.size() ? debounceMs[pcf2].as<uint16_t>() : DEFAULT_INPUT_DEBOUNCE_MS);
+    }
+  }
 
-  JsonObject properties1 = items1.createNestedObject("properties");
+  if (json.containsKey("defaultInputType"))
+  {
+    uint8_t inputType = parseInputType(json["defaultInputType"]);
 
-  JsonObject index1 = properties1.createNestedObject("index");
-  index1["title"] = "Index";
-  index1["type"] = "integer";
-  index1["minimum"] = 1;
-  index1["maximum"] = getMaxIndex();
+    if (inputType != INVALID_INPUT_TYPE)
+    {
+      setDefaultInputType(inputType);
+    }
+  }
 
-  JsonObject type1 = properties1.createNestedObject("type");
-  type1["title"] = "Type";
-  createOutputTypeEnum(type1);
+  if (json.containsKey("inputs"))
+  {
+    for (JsonVariant input : json["inputs"].as<JsonArray>())
+    {
+      jsonInputConfig(input);    
+    }
+  }
 
-  JsonObject timerSeconds1 = properties1.createNestedObject("timerSeconds");
-  timerSeconds1["title"] = "Timer (seconds)";
-  timerSeconds1["type"] = "integer";
-  timerSeconds1["minimum"] = 1;
+  if (commit) { commitConfig(); }
+}
 
-  JsonObject interlockIndex1 = properties1.createNestedObject("interlockIndex");
-  interlockIndex1["title"] = "Interlock With Index";
-  interlockIndex1["type"] = "integer";
-  interlockIndex1["minimum"] = 1;
-  interlockIndex1["maximum"] = getMaxIndex();
+/*--------------------------- JSON streaming -----------------*/
+const jsonArrayHandler_t CONFIG_ARRAY_HANDLERS[] = 
+{
+  { "outputs", NULL, jsonOutputConfig, NULL },
+  { "interlockGroups", beginInterlockGroupsConfig, jsonInterlockGroupConfig, endInterlockGroupsConfig },
+  { "scenes", beginScenesConfig, jsonSceneConfig, endScenesConfig },
+  { "inputs", NULL, jsonInputConfig, NULL },
+};
 
-  JsonArray required1 = items1.createNestedArray("required");
-  required1.add("index");
+const jsonArrayHandler_t COMMAND_ARRAY_HANDLERS[] = 
+{
+  { "outputs", NULL, jsonOutputCommand, NULL },
+};
 
-  // INPUTS
-  JsonObject defaultInputType2 = properties.createNestedObject("defaultInputType");
-  defaultInputType2["title"] = "Default Input Type";
-  defaultInputType2["description"] = "Set the default input type for anything without explicit configuration below. Defaults to ‘switch’.";
-  createInputTypeEnum(defaultInputType2);
+bool isArrayHandled(const jsonArrayHandler_t handlers[], uint8_t handlerCount, const char * key)
+{
+  for (uint8_t i = 0; i < handlerCount; i++)
+  {
+    if (strcmp(handlers[i].key, key) == 0) { return true; }
+  }
+  return false;
+}
 
-  JsonObject inputs2 = properties.createNestedObject("inputs");
-  inputs2["title"] = "Input Configuration";
-  inputs2["description"] = "Add configuration for each input in use on your device. The 1-based index specifies which input you wish to configure. The type defines how an input is monitored and what events are emitted. Inverting an input swaps the 'active' state (only useful for 'contact' and 'switch' inputs). Disabling an input stops any events being emitted.";
-  inputs2["type"] = "array";
-  
-  JsonObject items2 = inputs2.createNestedObject("items");
-  items2["type"] = "object";
+void streamJsonArrays(const char * json, size_t length, const jsonArrayHandler_t handlers[], uint8_t handlerCount, JsonDocument & element)
+{
+  char key[JSON_STREAM_KEY_SIZE];
+  const char * value;
+  size_t valueLength;
 
-  JsonObject properties2 = items2.createNestedObject("properties");
+  // Dispatch each element as soon as it is parsed, in handler order
+  for (uint8_t i = 0; i < handlerCount; i++)
+  {
+    JsonScanner members(json, length);
+    members.begin('{');
 
-  JsonObject index2 = properties2.createNestedObject("index");
-  index2["title"] = "Index";
-  index2["type"] = "integer";
-  index2["minimum"] = 1;
-  index2["maximum"] = getMaxIndex();
+    while (members.next(key, sizeof(key), &value, &valueLength))
+    {
+      if (strcmp(key, handlers[i].key) != 0)
+        continue;
 
-  JsonObject type2 = properties2.createNestedObject("type");
-  type2["title"] = "Type";
-  createInputTypeEnum(type2);
+      JsonScanner elements(value, valueLength);
+      if (!elements.begin('['))
+      {
+        logger.print(F("[stio] expected array for "));
+        logger.println(key);
+        continue;
+      }
 
-  JsonObject invert2 = properties2.createNestedObject("invert");
-  invert2["title"] = "Invert";
-  invert2["type"] = "boolean";
+      if (handlers[i].begin) { handlers[i].begin(); }
 
-  JsonObject disabled2 = properties2.createNestedObject("disabled");
-  disabled2["title"] = "Disabled";
-  disabled2["type"] = "boolean";
+      const char * item;
+      size_t itemLength;
+      while (elements.next(NULL, 0, &item, &itemLength))
+      {
+        if (deserializeJson(element, item, itemLength))
+        {
+          logger.print(F("[stio] failed to parse element of "));
+          logger.println(key);
+          continue;
+        }
+
+        handlers[i].element(element.as<JsonVariant>());
+      }
 
-  JsonArray required2 = items2.createNestedArray("required");
-  required2.add("index");
+      if (handlers[i].end) { handlers[i].end(); }
+    }
+  }
 }
 
-void getCommandSchemaJson(JsonVariant json)
+void streamJson(uint8_t * payload, unsigned int length, const jsonArrayHandler_t handlers[], uint8_t handlerCount, jsonCallback callback, bool arraysFirst)
 {
-  JsonObject commandSchema = json.createNestedObject("commandSchema");
-  
-  // Command schema metadata
-  commandSchema["$schema"] = JSON_SCHEMA_VERSION;
-  commandSchema["title"] = FW_SHORT_NAME;
-  commandSchema["type"] = "object";
+  const char * json = (const char *)payload;
 
-  JsonObject properties = commandSchema.createNestedObject("properties");
+  // Ignore empty messages, same as OXRS_MQTT
+  if (length == 0) { return; }
 
-  JsonObject outputs1 = properties.createNestedObject("outputs");
-  outputs1["title"] = "Output Commands";
-  outputs1["description"] = "Send commands to one or more outputs on your device. The 1-based index specifies which output you wish to command. The type is used to validate the configuration for this output matches the command. Supported commands are ‘on’ or ‘off’ to change the output state, or ‘query’ to publish the current state to MQTT.";
-  outputs1["type"] = "array";
-  
-  JsonObject items1 = outputs1.createNestedObject("items");
-  items1["type"] = "object";
+  JsonScanner members(json, length);
+  if (!members.begin('{'))
+  {
+    logger.println(F("[stio] invalid json payload"));
+    return;
+  }
 
-  JsonObject properties1 = items1.createNestedObject("properties");
+  DynamicJsonDocument rest(JSON_STREAM_REST_SIZE);
+  DynamicJsonDocument element(JSON_STREAM_ELEMENT_SIZE);
 
-  JsonObject index1 = properties1.createNestedObject("index");
-  index1["title"] = "Index";
-  index1["type"] = "integer";
-  index1["minimum"] = 1;
-  index1["maximum"] = getMaxIndex();
+  // Everything other than the handled arrays goes into one small document
+  char key[JSON_STREAM_KEY_SIZE];
+  const char * value;
+  size_t valueLength;
+  while (members.next(key, sizeof(key), &value, &valueLength))
+  {
+    if (isArrayHandled(handlers, handlerCount, key))
+      continue;
 
-  JsonObject type1 = properties1.createNestedObject("type");
-  type1["title"] = "Type";
-  createOutputTypeEnum(type1);
+    if (deserializeJson(element, value, valueLength))
+    {
+      logger.print(F("[stio] failed to parse "));
+      logger.println(key);
+      continue;
+    }
 
-  JsonObject command1 = properties1.createNestedObject("command");
-  command1["title"] = "Command";
-  command1["type"] = "string";
-  JsonArray commandEnum1 = command1.createNestedArray("enum");
-  commandEnum1.add("query");
-  commandEnum1.add("on");
-  commandEnum1.add("off");
+    rest[key].set(element.as<JsonVariant>());
+  }
 
-  JsonArray required1 = items1.createNestedArray("required");
-  required1.add("index");
-  required1.add("command");
+  if (arraysFirst) { streamJsonArrays(json, length, handlers, handlerCount, element); }
+  callback(rest.as<JsonVariant>());
+  if (!arraysFirst) { streamJsonArrays(json, length, handlers, handlerCount, element); }
 }
 
-void apiAdopt(JsonVariant json)
+void jsonStreamedCommand(JsonVariant json)
 {
-  // Build device adoption info
-  getFirmwareJson(json);
-  getSystemJson(json);
-  getNetworkJson(json);
-  getConfigSchemaJson(json);
-  getCommandSchemaJson(json);
+  // Normally handled by OXRS_MQTT
+  if (json.containsKey("restart") && json["restart"].as<bool>())
+  {
+    ESP.restart();
+  }
+
+  jsonCommand(json);
 }
 
-/*--------------------------- Initialisation -------------------------------*/
-void initialiseRestApi(void)
+void mqttCallback(char * topic, uint8_t * payload, unsigned int length) 
 {
-  // NOTE: this must be called *after* initialising MQTT since that sets
-  //       the default client id, which has lower precendence than MQTT
-  //       settings stored in file and loaded by the API
+  markIdleActivity();
 
-  // Set up the REST API
-  api.begin();
+  // Parse config and commands a piece at a time, rather than needing a 
+  // document big enough for every output and input at once. Config needs
+  // any defaults applied before the arrays, commands are the other way.
+  if (strcmp(topic, g_mqtt_config_topic) == 0)
+  {
+    beginConfig();
+    streamJson(payload, length, CONFIG_ARRAY_HANDLERS, sizeof(CONFIG_ARRAY_HANDLERS) / sizeof(jsonArrayHandler_t), jsonConfig, false);
+    commitConfig();
+    return;
+  }
 
-  // Register our callbacks
-  api.onAdopt(apiAdopt);
+  if (strcmp(topic, g_mqtt_command_topic) == 0)
+  {
+    startLatency(LATENCY_COMMAND);
+    streamJson(payload, length, COMMAND_ARRAY_HANDLERS, sizeof(COMMAND_ARRAY_HANDLERS) / sizeof(jsonArrayHandler_t), jsonStreamedCommand, true);
+    stopLatency(LATENCY_COMMAND);
+    return;
+  }
 
-  server.begin();
+  // Per-output command topics skip json entirely
+  size_t directLength = strlen(g_mqtt_direct_topic);
+  if (g_direct_commands && strncmp(topic, g_mqtt_direct_topic, directLength) == 0)
+  {
+    startLatency(LATENCY_COMMAND);
+    directOutputCommand(topic + directLength, payload, length);
+    stopLatency(LATENCY_COMMAND);
+    return;
+  }
+
+  // Pass anything else down to our MQTT handler
+  mqtt.receive(topic, payload, length);
 }
 
-/*--------------------------- MQTT/API -----------------*/
-void mqttConnected() 
+void initialiseMqtt(byte * mac)
 {
-  // MqttLogger doesn't copy the logging topic to an internal
-  // buffer so we have to use a static array here
-  static char logTopic[64];
-  logger.setTopic(mqtt.getLogTopic(logTopic));
+  // Set the default client id to the last 3 bytes of the MAC address
+  char clientId[32];
+  sprintf_P(clientId, PSTR("%02x%02x%02x"), mac[3], mac[4], mac[5]);  
+  mqtt.setClientId(clientId);
+  
+  // Register our callbacks
+  mqtt.onConnected(mqttConnected);
+  mqtt.onDisconnected(mqttDisconnected);
+  mqtt.onConfig(jsonConfig);
+  mqtt.onCommand(jsonCommand);  
 
-  // Publish device adoption info
-  DynamicJsonDocument json(JSON_ADOPT_MAX_SIZE);
-  mqtt.publishAdopt(api.getAdopt(json.as<JsonVariant>()));
+  // Don't let a broker which accepts the connection but never responds
+  // block the loop for the default 15s
+  mqttClient.setSocketTimeout(MQTT_SOCKET_TIMEOUT_S);
 
-  // Log the fact we are now connected
-  logger.println("[stio] mqtt connected");
+  // Start listening for MQTT messages
+  mqttClient.setCallback(mqttCallback);  
 }
 
-void mqttDisconnected(int state) 
+/*--------------------------- Bench -----------------*/
+void benchNoopJson(JsonVariant json)
 {
-  // Log the disconnect reason
-  // See https://github.com/knolleary/pubsubclient/blob/2d228f2f862a95846c65a8518c79f48dfc8f188c/src/PubSubClient.h#L44
-  switch (state)
-  {
-    case MQTT_CONNECTION_TIMEOUT:
-      logger.println(F("[stio] mqtt connection timeout"));
-      break;
-    case MQTT_CONNECTION_LOST:
-      logger.println(F("[stio] mqtt connection lost"));
-      break;
-    case MQTT_CONNECT_FAILED:
-      logger.println(F("[stio] mqtt connect failed"));
-      break;
-    case MQTT_DISCONNECTED:
-      logger.println(F("[stio] mqtt disconnected"));
-      break;
-    case MQTT_CONNECT_BAD_PROTOCOL:
-      logger.println(F("[stio] mqtt bad protocol"));
-      break;
-    case MQTT_CONNECT_BAD_CLIENT_ID:
-      logger.println(F("[stio] mqtt bad client id"));
-      break;
-    case MQTT_CONNECT_UNAVAILABLE:
-      logger.println(F("[stio] mqtt unavailable"));
-      break;
-    case MQTT_CONNECT_BAD_CREDENTIALS:
-      logger.println(F("[stio] mqtt bad credentials"));
-      break;      
-    case MQTT_CONNECT_UNAUTHORIZED:
-      logger.println(F("[stio] mqtt unauthorised"));
-      break;      
-  }
 }
 
-void jsonOutputCommand(JsonVariant json)
+const jsonArrayHandler_t BENCH_CONFIG_HANDLERS[] = 
 {
-  uint8_t index = getIndex(json);
-  if (index == 0) return;
-
-  // Work out the pcf and pin we are processing
-  uint8_t pcf1 = (index - 1) / g_pcf_output_pins;
-  uint8_t pin1 = (index - 1) % g_pcf_output_pins;
+  { "outputs", NULL, benchNoopJson, NULL },
+  { "inputs", NULL, benchNoopJson, NULL },
+};
 
-  // Get the output type for this pin
-  uint8_t type = oxrsOutput[pcf1].getType(pin1);
-  
-  if (json.containsKey("type"))
-  {
-    if (parseOutputType(json["type"]) != type)
-    {
-      logger.println(F("[stio] command type doesn't match configured type"));
-      return;
-    }
-  }
-  
-  if (json.containsKey("command"))
-  {
-    if (json["command"].isNull() || strcmp(json["command"], "query") == 0)
-    {
-      // Publish a status event with the current state
-      uint8_t state = pcf8575_DO[pcf1].digitalRead(pin1);
-      publishEventOutput(index, type, state);
-    }
-    else
-    {
-      // Send this command down to our output handler to process
-      if (strcmp(json["command"], "on") == 0)
-      {
-        oxrsOutput[pcf1].handleCommand(pcf1, pin1, RELAY_ON);
-      }
-      else if (strcmp(json["command"], "off") == 0)
-      {
-        oxrsOutput[pcf1].handleCommand(pcf1, pin1, RELAY_OFF);
-      }
-      else 
-      {
-        logger.println(F("[stio] invalid command"));
-      }
-    }
-  }
+const jsonArrayHandler_t BENCH_COMMAND_HANDLERS[] = 
+{
+  { "outputs", NULL, benchNoopJson, NULL },
+};
+
+void benchNoopInputEvent(uint8_t id, uint8_t input, uint8_t type, uint8_t state)
+{
 }
 
-void jsonCommand(JsonVariant json)
+void benchOutputEvent(uint16_t i)
 {
-  if (json.containsKey("outputs"))
+  StaticJsonDocument<64> json;
+  getOutputEventJson(json.as<JsonVariant>(), (i % CHANNEL_COUNT) + 1, RELAY, (i & 1) ? RELAY_ON : RELAY_OFF);
+
+  CountingPrint counter;
+  serializeJson(json, counter);
+  g_bench_sink += counter.count();
+}
+
+void benchInputEvent(uint16_t i)
+{
+  StaticJsonDocument<128> json;
+  getInputEventJson(json.as<JsonVariant>(), (i % CHANNEL_COUNT) + 1, SWITCH, i & 1, 0);
+
+  CountingPrint counter;
+  serializeJson(json, counter);
+  g_bench_sink += counter.count();
+}
+
+char * writeBenchArray(char * p, const char * key, const char * element)
+{
+  // An array with an element for every channel
+  p += sprintf(p, "\"%s\":[", key);
+  for (uint16_t index = 1; index <= CHANNEL_COUNT; index++)
   {
-    for (JsonVariant output : json["outputs"].as<JsonArray>())
-    {
-      jsonOutputCommand(output);
-    }
+    if (index > 1) { *p++ = ','; }
+    p += sprintf(p, element, index);
   }
+  return p + sprintf(p, "]");
 }
 
-void jsonOutputConfig(JsonVariant json)
+bool benchPrepareConfig()
 {
-  uint8_t index = getIndex(json);
-  if (index == 0) return;
+  // Full size payload, same shape as a real config
+  g_bench_payload = (uint8_t *)malloc(BENCH_PAYLOAD_SIZE);
+  if (!g_bench_payload) { return false; }
+
+  char * p = (char *)g_bench_payload;
+  p += sprintf(p, "{\"defaultOutputType\":\"relay\",\"defaultInputType\":\"switch\",");
+  p = writeBenchArray(p, "outputs", "{\"index\":%u,\"type\":\"timer\",\"timerSeconds\":60,\"interlockIndex\":null}");
+  *p++ = ',';
+  p = writeBenchArray(p, "inputs", "{\"index\":%u,\"type\":\"button\",\"invert\":false,\"rateLimit\":20}");
+  p += sprintf(p, "}");
+  g_bench_payload_length = p - (char *)g_bench_payload;
+  return true;
+}
 
-  // Work out the MCP and pin we are configuring
-  uint8_t pcf1 = (index - 1) / g_pcf_output_pins;
-  uint8_t pin1 = (index - 1) % g_pcf_output_pins;
+bool benchPrepareCommand()
+{
+  // Full size payload, same shape as a real command batch
+  g_bench_payload = (uint8_t *)malloc(BENCH_PAYLOAD_SIZE);
+  if (!g_bench_payload) { return false; }
+
+  char * p = (char *)g_bench_payload;
+  *p++ = '{';
+  p = writeBenchArray(p, "outputs", "{\"index\":%u,\"command\":\"query\"}");
+  p += sprintf(p, "}");
+  g_bench_payload_length = p - (char *)g_bench_payload;
+  return true;
+}
 
-  if (json.containsKey("type"))
-  {
-    uint8_t outputType = parseOutputType(json["type"]);    
+void benchConfig(uint16_t i)
+{
+  streamJson(g_bench_payload, g_bench_payload_length, BENCH_CONFIG_HANDLERS, sizeof(BENCH_CONFIG_HANDLERS) / sizeof(jsonArrayHandler_t), benchNoopJson, false);
+}
 
-    if (outputType != INVALID_OUTPUT_TYPE)
-    {
-      oxrsOutput[pcf1].setType(pin1, outputType);
-    }
-  }
-  
-  if (json.containsKey("timerSeconds"))
+void benchCommand(uint16_t i)
+{
+  streamJson(g_bench_payload, g_bench_payload_length, BENCH_COMMAND_HANDLERS, sizeof(BENCH_COMMAND_HANDLERS) / sizeof(jsonArrayHandler_t), benchNoopJson, true);
+}
+
+void benchAdopt(uint16_t i)
+{
+  DynamicJsonDocument json(JSON_ADOPT_MAX_SIZE);
+  g_bench_sink += measureJson(api.getAdopt(json.as<JsonVariant>()));
+}
+
+void benchInputs(uint16_t i)
+{
+  // One pass of the input handlers for every board, against a simulated 
+  // word which flips a single pin each iteration
+  for (uint8_t pcf = 0; pcf < PCF_COUNT; pcf++)
   {
-    if (json["timerSeconds"].isNull())
-    {
-      oxrsOutput[pcf1].setTimer(pin1, DEFAULT_TIMER_SECS);
-    }
-    else
-    {
-      oxrsOutput[pcf1].setTimer(pin1, json["timerSeconds"].as<int>());
-    }
+    oxrsBenchInput.process(pcf, 0xFFFF ^ (1 << (i % PCF_PIN_COUNT)));
   }
-  
-  if (json.containsKey("interlockIndex"))
+}
+
+void benchDebounce(uint16_t i)
+{
+  // The pre-filter for every board, against the same simulated words
+  for (uint8_t pcf = 0; pcf < PCF_COUNT; pcf++)
   {
-    // If an empty message then treat as 'unlocked' - i.e. interlock with ourselves
-    if (json["interlockIndex"].isNull())
-    {
-      oxrsOutput[pcf1].setInterlock(pin1, pin1);
-    }
-    else
-    {
-      uint8_t interlock_index = json["interlockIndex"].as<uint8_t>();
-     
-      uint8_t interlock_pcf1 = (interlock_index - 1) / g_pcf_output_pins;
-      uint8_t interlock_pin1 = (interlock_index - 1) % g_pcf_output_pins;
-  
-      if (interlock_pcf1 == pcf1)
-      {
-        oxrsOutput[pcf1].setInterlock(pin1, interlock_pin1);
-      }
-      else
-      {
-        logger.println(F("[stio] lock must be with pin on same mcp"));
-      }
-    }
+    g_bench_sink += debounceWord(&g_bench_debounce[pcf], 0xFFFF ^ (1 << (i % PCF_PIN_COUNT)));
   }
 }
 
-void jsonInputConfig(JsonVariant json)
+const benchmark_t BENCHMARKS[] = 
 {
-  uint8_t index = getIndex(json);
-  if (index == 0) return;
+  { "outputEvent", BENCH_FAST_ITERATIONS, 0, NULL, benchOutputEvent },
+  { "inputEvent", BENCH_FAST_ITERATIONS, 0, NULL, benchInputEvent },
+  { "config", BENCH_SLOW_ITERATIONS, BENCH_PAYLOAD_SIZE, benchPrepareConfig, benchConfig },
+  { "command", BENCH_SLOW_ITERATIONS, BENCH_PAYLOAD_SIZE, benchPrepareCommand, benchCommand },
+  { "adopt", BENCH_SLOW_ITERATIONS, JSON_ADOPT_MAX_SIZE, NULL, benchAdopt },
+  { "inputs", BENCH_FAST_ITERATIONS, 0, NULL, benchInputs },
+  { "debounce", BENCH_FAST_ITERATIONS, 0, NULL, benchDebounce },
+};
+
+const uint8_t BENCH_COUNT = sizeof(BENCHMARKS) / sizeof(benchmark_t);
+benchResult_t g_bench_results[BENCH_COUNT];
+
+void startBench()
+{
+  memset(g_bench_results, 0, sizeof(g_bench_results));
+  memset(g_bench_debounce, 0, sizeof(g_bench_debounce));
+  oxrsBenchInput.begin(benchNoopInputEvent, SWITCH);
 
-  // Work out the PCF and pin we are configuring
-  int pcf2 = (index - 1) / PCF_PIN_COUNT;
-  int pin2 = (index - 1) % PCF_PIN_COUNT;
+  g_bench_heap_free_bytes = ESP.getFreeHeap();
+  g_bench_index = 0;
+  g_bench_state = BENCH_RUNNING;
+}
 
-  if (json.containsKey("type"))
-  {
-    uint8_t inputType = parseInputType(json["type"]);    
+void finishBenchmark()
+{
+  free(g_bench_payload);
+  g_bench_payload = NULL;
 
-    if (inputType != INVALID_INPUT_TYPE)
+  if (++g_bench_index >= BENCH_COUNT) { g_bench_state = BENCH_DONE; }
+}
+
+void processBench()
+{
+  if (g_bench_state != BENCH_RUNNING) { return; }
+
+  // Keep the loop awake until the run is finished
+  markIdleActivity();
+
+  const benchmark_t * benchmark = &BENCHMARKS[g_bench_index];
+  benchResult_t * result = &g_bench_results[g_bench_index];
+
+  // Only start a benchmark if what it allocates will fit
+  if (result->iterations == 0)
+  {
+    if ((benchmark->heapBytes > 0 && ESP.getMaxAllocHeap() < benchmark->heapBytes + BENCH_HEAP_HEADROOM) ||
+        (benchmark->prepare && !benchmark->prepare()))
     {
-      // Pass this update to the input handler
-      oxrsInput[pcf2].setType(pin2, inputType);
+      result->skipped = true;
+      finishBenchmark();
+      return;
     }
   }
-  
-  if (json.containsKey("invert"))
-  {
-    // Pass this update to the input handler
-    oxrsInput[pcf2].setInvert(pin2, json["invert"].as<bool>());
-  }
 
-  if (json.containsKey("disabled"))
+  // Run as many iterations as fit in a slice, so a pass of the loop is
+  // never held up for long and the supervisor sees the real pass time
+  int64_t sliceUs = min((uint32_t)BENCH_SLICE_US, g_loop_budget_ms * 500);
+  int64_t start = esp_timer_get_time();
+  int64_t now = start;
+  while (result->iterations < benchmark->iterations && (now - start) < sliceUs)
   {
-    // Pass this update to the input handler
-    oxrsInput[pcf2].setDisabled(pin2, json["invert"].as<bool>());
+    benchmark->run(result->iterations++);
+    now = esp_timer_get_time();
   }
+  result->totalUs += now - start;
+
+  if (result->iterations >= benchmark->iterations) { finishBenchmark(); }
 }
 
-void jsonConfig(JsonVariant json)
+void apiBench(Request &req, Response &res)
 {
-  // OUTPUTS
-  if (json.containsKey("outputsPerMcp"))
-  {
-    g_pcf_output_pins = json["outputsPerMcp"].as<uint8_t>();
-  }
-  
-  if (json.containsKey("defaultOutputType"))
-  {
-    uint8_t outputType = parseOutputType(json["defaultOutputType"]);
+  // The first request starts a run, which then continues from the loop
+  if (g_bench_state == BENCH_IDLE) { startBench(); }
 
-    if (outputType != INVALID_OUTPUT_TYPE)
-    {
-      setDefaultOutputType(outputType);
-    }
-  }
+  res.set("Content-Type", "application/json");
 
-  if (json.containsKey("outputs"))
+  if (g_bench_state == BENCH_RUNNING)
   {
-    for (JsonVariant output : json["outputs"].as<JsonArray>())
-    {
-      jsonOutputConfig(output);
-    }
+    StaticJsonDocument<128> json;
+    json["running"] = true;
+    json["completed"] = g_bench_index;
+    json["total"] = BENCH_COUNT;
+
+    res.status(202);
+    serializeJson(json, res);
+    return;
   }
 
-  // INPUTS
-  if (json.containsKey("defaultInputType"))
+  StaticJsonDocument<1024> json;
+  json["cpuMhz"] = getCpuFrequencyMhz();
+  json["heapFreeBytes"] = g_bench_heap_free_bytes;
+
+  JsonArray results = json.createNestedArray("benchmarks");
+  for (uint8_t b = 0; b < BENCH_COUNT; b++)
   {
-    uint8_t inputType = parseInputType(json["defaultInputType"]);
+    JsonObject result = results.createNestedObject();
+    result["name"] = BENCHMARKS[b].name;
 
-    if (inputType != INVALID_INPUT_TYPE)
+    if (g_bench_results[b].skipped)
     {
-      setDefaultInputType(inputType);
+      result["skipped"] = true;
+      continue;
     }
-  }
 
-  if (json.containsKey("inputs"))
-  {
-    for (JsonVariant input : json["inputs"].as<JsonArray>())
-    {
-      jsonInputConfig(input);    
-    }
+    result["iterations"] = g_bench_results[b].iterations;
+    result["totalUs"] = g_bench_results[b].totalUs;
+    result["usPerOp"] = (float)g_bench_results[b].totalUs / g_bench_results[b].iterations;
   }
-}
 
-void mqttCallback(char * topic, uint8_t * payload, unsigned int length) 
-{
-  // Pass this message down to our MQTT handler
-  mqtt.receive(topic, payload, length);
+  // Results are only returned once, the next request starts a new run
+  g_bench_state = BENCH_IDLE;
+
+  serializeJson(json, res);
 }
 
-void initialiseMqtt(byte * mac)
+/*--------------------------- Initialisation -------------------------------*/
+void initialiseRestApi(void)
 {
-  // Set the default client id to the last 3 bytes of the MAC address
-  char clientId[32];
-  sprintf_P(clientId, PSTR("%02x%02x%02x"), mac[3], mac[4], mac[5]);  
-  mqtt.setClientId(clientId);
-  
+  // NOTE: this must be called *after* initialising MQTT since that sets
+  //       the default client id, which has lower precendence than MQTT
+  //       settings stored in file and loaded by the API
+
+  // Set up the REST API
+  api.begin();
+
+  // Load any scenes now the API has mounted the file system
+  loadScenes();
+
   // Register our callbacks
-  mqtt.onConnected(mqttConnected);
-  mqtt.onDisconnected(mqttDisconnected);
-  mqtt.onConfig(jsonConfig);
-  mqtt.onCommand(jsonCommand);  
+  api.onAdopt(apiAdopt);
+  api.get("/stalls", &apiStalls);
+  api.get("/connection", &apiConnection);
+  api.get("/stats", &apiStats);
+  api.get("/metrics", &apiMetrics);
+  api.get("/latency", &apiLatency);
+  api.get("/capture", &apiCapture);
+  api.get("/bench", &apiBench);
 
-  // Start listening for MQTT messages
-  mqttClient.setCallback(mqttCallback);  
+  server.begin();
+  wsServer.begin();
 }
 
 /*--------------------------- Network -------------------------------*/
@@ -1010,7 +5591,21 @@ void ethernetEvent(WiFiEvent_t event)
       // Set up MQTT (don't attempt to connect yet)
       initialiseMqtt(mac);
       break;
+    case ARDUINO_EVENT_ETH_CONNECTED:
+      g_eth_link_up = true;
+      break;
+    case ARDUINO_EVENT_ETH_DISCONNECTED:
+      logger.println(F("[stio] ethernet link down"));
+      g_eth_link_up = false;
+      g_eth_got_ip = false;
+      break;
+    case ARDUINO_EVENT_ETH_STOP:
+      g_eth_link_up = false;
+      g_eth_got_ip = false;
+      break;
     case ARDUINO_EVENT_ETH_GOT_IP:
+      g_eth_got_ip = true;
+
       // Get the IP address assigned by DHCP
       IPAddress ip = ETH.localIP();
 
@@ -1056,6 +5651,11 @@ void inputEvent(uint8_t id, uint8_t input, uint8_t type, uint8_t state)
   uint8_t pcf = id;
   uint8_t index = (PCF_PIN_COUNT * pcf) + input + 1;
 
+  updateChannelStats(&g_input_stats[index - 1]);
+
+  // Drop (and summarise) events from any input exceeding its rate limit
+  if (!allowInputEvent(index, type, state)) return;
+
   // Publish the event
   publishEventInput(index, type, state);
 }
@@ -1069,7 +5669,10 @@ void outputEvent(uint8_t id, uint8_t output, uint8_t type, uint8_t state)
   uint8_t index = raw_index + 1;
   
   // Update the MCP pin - i.e. turn the relay on/off (LOW/HIGH)
-  pcf8575_DO[pcf].digitalWrite(pin, state);
+  switchOutput(pcf, pin, state);
+
+  // Waiting on its interlock group to break, published once it makes
+  if (state == RELAY_ON && deferInterlockEvent(pcf, pin)) return;
 
   // Publish the event
   publishEventOutput(index, type, state);
@@ -1078,6 +5681,8 @@ void outputEvent(uint8_t id, uint8_t output, uint8_t type, uint8_t state)
 /*--------------------------- I2C -------------------------------*/
 void scanI2CBus()
 {
+  g_do_mutex = xSemaphoreCreateMutex();
+
   logger.println(F("[stio] scanning for output buffers..."));
 
   for (uint8_t pcf1 = 0; pcf1 < PCF_COUNT; pcf1++)
@@ -1092,16 +5697,25 @@ void scanI2CBus()
     {
       bitWrite(g_pcfs_found_do, pcf1, 1);
 
-      // If an MCP23017 was found then initialise and configure the outputs
+      // If an MCP23017 was found then initialise and configure the outputs,
+      // restoring any journalled outputs (everything else off) in a single
+      // write so nothing glitches on while we set up
       pcf8575_DO[pcf1].begin(PCF_I2C_ADDRESS[pcf1],&Wire);
+      g_do_shadow[pcf1] = getRestoredOutputs(pcf1);
+      pcf8575_DO[pcf1].digitalWriteWord(g_do_shadow[pcf1]);
+
+      // Initialise output handlers (default to RELAY)
+      oxrsOutput[pcf1].begin(outputEvent, RELAY);
+      g_pcf_relay_pins[pcf1] = 0xFFFF;
+
+      // Track what the handlers were initialised with, so config only
+      // needs to touch channels which differ
       for (uint8_t pin = 0; pin < PCF_PIN_COUNT; pin++)
       {
-        pcf8575_DO[pcf1].pinMode(pin, OUTPUT);
-        pcf8575_DO[pcf1].digitalWrite(pin, RELAY_OFF);
+        g_output_config[pcf1][pin].type = RELAY;
+        g_output_config[pcf1][pin].interlock = pin;
+        g_output_config[pcf1][pin].timerSeconds = DEFAULT_TIMER_SECS;
       }
-
-      // Initialise output handlers
-      oxrsOutput[pcf1].begin(outputEvent, RELAY);
       
       logger.println(F("PCF8575"));
     }
@@ -1134,6 +5748,15 @@ void scanI2CBus()
 
       // Initialise input handlers (default to SWITCH)
       oxrsInput[pcf2].begin(inputEvent, SWITCH);
+      for (uint8_t pin = 0; pin < PCF_PIN_COUNT; pin++)
+      {
+        resetInputLimiter((PCF_PIN_COUNT * pcf2) + pin + 1, DEFAULT_INPUT_RATE_LIMIT);
+
+        g_input_config[pcf2][pin].type = SWITCH;
+        g_input_config[pcf2][pin].rateLimit = DEFAULT_INPUT_RATE_LIMIT;
+        g_input_config[pcf2][pin].invert = false;
+        g_input_config[pcf2][pin].disabled = false;
+      }
 
       logger.print(F("PCF8575"));
       if (PCF_INTERNAL_PULLUPS) { logger.print(F(" (internal pullups)")); }
@@ -1146,6 +5769,102 @@ void scanI2CBus()
   }
 }
 
+/*--------------------------- Supervisor -------------------------------*/
+void recordStall(uint32_t passStartMs, uint32_t now)
+{
+  uint32_t durationMs = now - g_loop_phase_start_ms;
+
+  portENTER_CRITICAL(&g_stall_mux);
+
+  // Start a new record the first time we see this pass over budget,
+  // otherwise keep updating the current one until the loop recovers
+  if (g_stall_count == 0 || g_stall_pass_start_ms != passStartMs)
+  {
+    g_stall_pass_start_ms = passStartMs;
+    g_stalls[g_stall_head].uptimeMs = now;
+    g_stalls[g_stall_head].durationMs = 0;
+    g_stall_head = (g_stall_head + 1) % STALL_RECORD_COUNT;
+    if (g_stall_count < STALL_RECORD_COUNT) { g_stall_count++; }
+  }
+
+  // Keep whichever phase has been blocking the longest
+  stallRecord_t * stall = &g_stalls[(g_stall_head + STALL_RECORD_COUNT - 1) % STALL_RECORD_COUNT];
+  if (durationMs >= stall->durationMs)
+  {
+    stall->phase = g_loop_phase;
+    stall->durationMs = durationMs;
+  }
+  stall->published = false;
+  g_stall_unpublished = true;
+
+  portEXIT_CRITICAL(&g_stall_mux);
+}
+
+void supervisorTask(void * param)
+{
+  // Only feed the task watchdog while the loop is healthy, so a loop
+  // which never recovers will eventually reset the device
+  esp_task_wdt_add(NULL);
+
+  for (;;)
+  {
+    bool sleeping = g_loop_sleeping;
+    uint32_t passStartMs = g_loop_pass_start_ms;
+    uint32_t now = millis();
+
+    if (!sleeping && (now - passStartMs) > g_loop_budget_ms)
+    {
+      recordStall(passStartMs, now);
+    }
+    else
+    {
+      esp_task_wdt_reset();
+    }
+
+    vTaskDelay(pdMS_TO_TICKS(SUPERVISOR_INTERVAL_MS));
+  }
+}
+
+esp_err_t initialiseTaskWatchdog()
+{
+  esp_err_t err = esp_task_wdt_init(TASK_WDT_TIMEOUT_S, true);
+  if (err != ESP_ERR_INVALID_STATE) { return err; }
+
+  // Already started by the core, so the idle tasks have to be taken off
+  // before it can be torn down and started again with our timeout
+  bool idleWatched[portNUM_PROCESSORS];
+  for (uint8_t cpu = 0; cpu < portNUM_PROCESSORS; cpu++)
+  {
+    TaskHandle_t idle = xTaskGetIdleTaskHandleForCPU(cpu);
+    idleWatched[cpu] = esp_task_wdt_status(idle) == ESP_OK;
+    if (idleWatched[cpu]) { esp_task_wdt_delete(idle); }
+  }
+
+  err = esp_task_wdt_deinit();
+  if (err == ESP_OK) { err = esp_task_wdt_init(TASK_WDT_TIMEOUT_S, true); }
+
+  for (uint8_t cpu = 0; cpu < portNUM_PROCESSORS; cpu++)
+  {
+    if (idleWatched[cpu]) { esp_task_wdt_add(xTaskGetIdleTaskHandleForCPU(cpu)); }
+  }
+
+  return err;
+}
+
+void initialiseSupervisor()
+{
+  g_loop_pass_start_ms = millis();
+  
+  esp_err_t err = initialiseTaskWatchdog();
+  if (err != ESP_OK)
+  {
+    logger.print(F("[stio] failed to set task watchdog timeout: "));
+    logger.println(esp_err_to_name(err));
+  }
+
+  xTaskCreatePinnedToCore(supervisorTask, "supervisor", SUPERVISOR_STACK_SIZE, NULL, 1, NULL, SUPERVISOR_CORE);
+}
+
 /*--------------------------- Program -------------------------------*/
 void setup()
 {
@@ -1156,9 +5875,24 @@ void setup()
   I2Cone.begin(I2C_SDA, I2C_SCL);
   I2Ctwo.begin(I2C_SDA2, I2C_SCL2);
 
+  // Load the output journal so outputs can be restored during the scan
+  initialiseJournal();
+
   // Scan the I2C bus and set up I/O buffers
   scanI2CBus();
 
+  // Start the pulse timer
+  initialisePulses();
+
+  // Start watching for loop stalls
+  initialiseSupervisor();
+
+  // Start the input sample timer
+  initialiseSampling();
+
+  // So the pulse and sample tasks can wake the loop from an idle sleep
+  g_loop_task = xTaskGetCurrentTaskHandle();
+
   // Set up network/MQTT/REST API
   #if defined(WIFIMODE)
   initialiseWifi();
@@ -1169,33 +5903,98 @@ void setup()
 
 void loop()
 {
+  // Let the supervisor know we have started a new pass
+  g_loop_pass_start_ms = millis();
+  uint32_t passStartUs = micros();
+
+  // Anything which asked to wake us before now is handled by this pass,
+  // so only requests from here on should cut the next idle sleep short
+  ulTaskNotifyTake(pdTRUE, 0);
+  g_idle_wake_us = 0;
+
   // Check our MQTT broker connection is still ok
-  mqtt.loop();
+  setLoopPhase(PHASE_MQTT);
+  loopMqtt();
   
   // Handle any API requests
+  setLoopPhase(PHASE_API);
   WiFiClient client = server.available();
+  if (client) { markIdleActivity(); }
   api.loop(&client);
 
+  // Handle any websocket clients
+  processWebSockets();
+
   // OUTPUTS - Iterate through each of the MCP23017s
-  for (uint8_t pcf1 = 0; pcf1 < PCF_COUNT; pcf1++)
+  setLoopPhase(PHASE_OUTPUTS);
+  forEachPcf(g_pcfs_found_do, [](uint8_t pcf1)
   {
-    if (bitRead(g_pcfs_found_do, pcf1) == 0) 
-      continue;
-    
     // Check for any output events
     oxrsOutput[pcf1].process();
-  }
+  });
+
+  // Publish any pulses which have finished since the last pass
+  publishPulses();
+
+  // Switch on any outputs whose interlock group has had time to break
+  processInterlockMakes();
+
+  // Publish any outputs switched off by an interlock group
+  publishInterlocks();
+
+  // Journal any output changes which need to be restored at boot
+  processJournal();
 
   // INPUTS - Iterate through each of the MCP23017s
-  for (uint8_t pcf2 = 0; pcf2 < PCF_COUNT; pcf2++)
+  setLoopPhase(PHASE_INPUTS);
+
+  // Anything sampled by the timer first, including any left over from
+  // just before sampling was switched off
+  processInputSamples();
+
+  if (g_sample_hz == 0)
   {
-    if (bitRead(g_pcfs_found_di, pcf2) == 0)
-      continue;
+    forEachPcf(g_pcfs_found_di, [](uint8_t pcf2)
+    {
+      // Read the values for all 16 pins on this MCP, skipping this pass 
+      // if the read failed rather than processing a stale value
+      uint16_t io_value;
+      if (!readInputs(pcf2, &io_value))
+        return;
+
+      processInputWord(pcf2, io_value, millis(), micros());
+    });
+  }
+
+  // Summarise any inputs which are being rate limited
+  processInputLimiters();
+
+  setLoopPhase(PHASE_LOOP);
 
-    // Read the values for all 16 pins on this MCP
-    uint16_t io_value = pcf8575_DI[pcf2].digitalReadWord();
+  // Write any captured samples to flash
+  processCapture();
 
-    // Check for any input events
-    oxrsInput[pcf2].process(pcf2, io_value);
+  // Run the next slice of any benchmarks
+  processBench();
+
+  // Publish any Home Assistant discovery configs which have changed
+  processHassDiscovery();
+
+  // Publish channel stats periodically
+  if (g_stats_interval_ms > 0 && (millis() - g_stats_last_ms) >= g_stats_interval_ms)
+  {
+    publishStats();
+    g_stats_last_ms = millis();
+  }
+
+  // Publish any stalls once the loop has recovered
+  if (g_stall_unpublished && mqtt.connected())
+  {
+    publishStalls();
   }
+
+  recordLoopDuration(micros() - passStartUs);
+
+  // Sleep until the next deadline if there is nothing to do
+  pauseIdleLoop();
 }
\ No newline at end of file
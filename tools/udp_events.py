@@ -0,0 +1,85 @@
+#!/usr/bin/env python3
+"""
+Receive and print the UDP event stream from OXRS-AC-StateIO-KINCONY-FW.
+
+Enable the stream by setting "udpEventAddress" (and optionally
+"udpEventPort") in the device config, then run e.g.
+
+  python3 tools/udp_events.py --group 239.0.0.1
+  python3 tools/udp_events.py              # for a unicast address
+
+Each datagram is a single fixed size little-endian record. Gaps in the
+per device sequence number are reported as lost events.
+"""
+
+import argparse
+import socket
+import struct
+import sys
+
+# Must match udpEventRecord_t in src/main.cpp
+RECORD = struct.Struct("<HBBIIBBBBH")
+MAGIC = 0x4553
+VERSION = 1
+DEFAULT_PORT = 5147
+
+KINDS = {0: "input", 1: "output"}
+
+INPUT_TYPES = {0: "button", 1: "contact", 2: "press", 3: "rotary", 4: "security", 5: "switch", 6: "toggle"}
+OUTPUT_TYPES = {0: "relay", 1: "motor", 2: "timer", 10: "pulse"}
+
+
+def open_socket(group, port, interface):
+    sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM, socket.IPPROTO_UDP)
+    sock.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+    sock.bind(("", port))
+
+    if group:
+        membership = socket.inet_aton(group) + socket.inet_aton(interface)
+        sock.setsockopt(socket.IPPROTO_IP, socket.IP_ADD_MEMBERSHIP, membership)
+
+    return sock
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Receive the StateIO UDP event stream")
+    parser.add_argument("--group", help="multicast group to join, omit for unicast")
+    parser.add_argument("--port", type=int, default=DEFAULT_PORT)
+    parser.add_argument("--interface", default="0.0.0.0", help="local interface to join the group on")
+    args = parser.parse_args()
+
+    sock = open_socket(args.group, args.port, args.interface)
+    expected = {}
+    lost = 0
+
+    while True:
+        data, (host, _) = sock.recvfrom(64)
+
+        if len(data) != RECORD.size:
+            print(f"{host}: ignoring {len(data)} byte datagram", file=sys.stderr)
+            continue
+
+        magic, version, kind, sequence, ms, index, type_, state, _, suppressed = RECORD.unpack(data)
+        if magic != MAGIC or version != VERSION:
+            print(f"{host}: ignoring unknown record (magic {magic:#06x}, version {version})", file=sys.stderr)
+            continue
+
+        # A lower sequence than expected means the device restarted
+        if host in expected and sequence > expected[host]:
+            missed = sequence - expected[host]
+            lost += missed
+            print(f"{host}: lost {missed} event(s), {lost} in total", file=sys.stderr)
+        expected[host] = sequence + 1
+
+        types = INPUT_TYPES if kind == 0 else OUTPUT_TYPES
+        line = f"{host} #{sequence} {ms}ms {KINDS.get(kind, kind)} {index} {types.get(type_, type_)} state={state}"
+        if suppressed:
+            line += f" suppressed={suppressed}"
+        print(line, flush=True)
+
+
+if __name__ == "__main__":
+    try:
+        main()
+    except KeyboardInterrupt:
+        pass